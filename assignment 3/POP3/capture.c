@@ -0,0 +1,250 @@
+/* capture.c
+ * Session capture.
+ *
+ * Sessions append their records to an in-memory buffer under a lock
+ * held only for the copy; a background thread swaps in a second
+ * buffer and writes the full one out, so sessions never wait for the
+ * disk. If the writer falls behind and the buffer fills up, records
+ * are dropped (and counted) rather than slowing the server down.
+ *
+ * Responses are not stored, only summarized: send_all() reports every
+ * byte a session sends through capture_sent(), which finds the
+ * session by its socket and updates the length and hash of the
+ * response in progress. A response is complete when the next command
+ * arrives, as a session answers one command at a time.
+ */
+
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#define CAPTURE_BUFFER_SIZE (4 * 1024 * 1024)
+#define MAX_CAPTURE_FDS     (1 << 20)
+
+struct capture_session {
+    uint64_t id;
+    int fd;
+    int command_seen;           // A response is in progress
+    capture_response response;
+    size_t line_len;
+    int line_done;              // The first line of the response is complete
+    char line[CAPTURE_LINE_SIZE];
+};
+
+static int capture_fd = -1;
+static struct timespec capture_started;
+static atomic_uint_fast64_t next_session;
+static atomic_ulong dropped;
+
+// Session of each socket, so capture_sent() can find it.
+static capture_session **sessions_by_fd;
+static size_t max_fds;
+
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buffer_ready = PTHREAD_COND_INITIALIZER;
+static char *active, *spare;
+static size_t active_used;
+
+/** Updates an FNV-1a hash with some bytes. Start with
+ *  CAPTURE_HASH_INIT.
+ */
+uint64_t capture_hash(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void write_out(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(capture_fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("capture");
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/* Writes out whatever the sessions have recorded, at least every
+ * tenth of a second. */
+static void *writer_thread(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&buffer_lock);
+        if (active_used < CAPTURE_BUFFER_SIZE / 2) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&buffer_ready, &buffer_lock, &deadline);
+        }
+        char *full = active;
+        size_t used = active_used;
+        active = spare;
+        active_used = 0;
+        spare = full;
+        pthread_mutex_unlock(&buffer_lock);
+
+        write_out(full, used);
+        unsigned long lost = atomic_exchange(&dropped, 0);
+        if (lost)
+            fprintf(stderr, "capture: %lu records dropped\n", lost);
+    }
+    return NULL;
+}
+
+/* Writes out the records still buffered when the process exits. */
+static void capture_flush(void) {
+    pthread_mutex_lock(&buffer_lock);
+    write_out(active, active_used);
+    active_used = 0;
+    pthread_mutex_unlock(&buffer_lock);
+}
+
+static void record(const capture_session *s, int type, const void *data1, size_t len1,
+                   const void *data2, size_t len2) {
+    capture_record header = { s->id, 0, len1 + len2, type, { 0 } };
+    size_t total = sizeof(header) + len1 + len2;
+
+    pthread_mutex_lock(&buffer_lock);
+    if (active_used + total > CAPTURE_BUFFER_SIZE) {
+        pthread_mutex_unlock(&buffer_lock);
+        atomic_fetch_add(&dropped, 1);
+        return;
+    }
+    // Taken under the lock, so that times in the file never go back.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    header.time_us = (now.tv_sec - capture_started.tv_sec) * 1000000 +
+                     (now.tv_nsec - capture_started.tv_nsec) / 1000;
+    char *p = active + active_used;
+    memcpy(p, &header, sizeof(header));
+    memcpy(p + sizeof(header), data1, len1);
+    memcpy(p + sizeof(header) + len1, data2, len2);
+    active_used += total;
+    if (active_used >= CAPTURE_BUFFER_SIZE / 2)
+        pthread_cond_signal(&buffer_ready);
+    pthread_mutex_unlock(&buffer_lock);
+}
+
+/** Starts capturing all sessions to a file, replacing its contents.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int capture_start(const char *path) {
+    struct rlimit limit;
+    max_fds = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < MAX_CAPTURE_FDS
+              ? limit.rlim_cur : MAX_CAPTURE_FDS;
+    sessions_by_fd = calloc(max_fds, sizeof(*sessions_by_fd));
+    active = malloc(CAPTURE_BUFFER_SIZE);
+    spare = malloc(CAPTURE_BUFFER_SIZE);
+    if (!sessions_by_fd || !active || !spare)
+        return -1;
+
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (capture_fd < 0)
+        return -1;
+    write_out(CAPTURE_MAGIC, strlen(CAPTURE_MAGIC));
+    clock_gettime(CLOCK_MONOTONIC, &capture_started);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer_thread, NULL) != 0) {
+        close(capture_fd);
+        capture_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    atexit(capture_flush);
+    return 0;
+}
+
+/** Starts recording a session.
+ *
+ *  Parameters: fd: The session's socket.
+ *
+ *  Returns: The session's capture state, or NULL if not capturing.
+ */
+capture_session *capture_open(int fd) {
+    if (capture_fd < 0 || fd < 0 || (size_t) fd >= max_fds)
+        return NULL;
+    capture_session *s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+    s->id = atomic_fetch_add(&next_session, 1) + 1;
+    s->fd = fd;
+    sessions_by_fd[fd] = s;
+    record(s, CAP_OPEN, NULL, 0, NULL, 0);
+    return s;
+}
+
+/* Records the summary of the response in progress, if any. */
+static void finish_response(capture_session *s) {
+    if (!s->command_seen)
+        return;
+    record(s, CAP_RESPONSE, &s->response, sizeof(s->response), s->line, s->line_len);
+    s->command_seen = 0;
+}
+
+/** Records a command received by a session (does nothing if s is
+ *  NULL).
+ */
+void capture_command(capture_session *s, const char *line, size_t len) {
+    if (!s)
+        return;
+    finish_response(s);
+    record(s, CAP_COMMAND, line, len, NULL, 0);
+    s->command_seen = 1;
+    s->response.bytes = 0;
+    s->response.hash = CAPTURE_HASH_INIT;
+    s->line_len = 0;
+    s->line_done = 0;
+}
+
+/** Accounts for bytes sent on a socket, as part of the response to
+ *  the last command captured on it (if any).
+ */
+void capture_sent(int fd, const void *data, size_t len) {
+    capture_session *s;
+    if (capture_fd < 0 || fd < 0 || (size_t) fd >= max_fds || !(s = sessions_by_fd[fd]) ||
+        !s->command_seen)
+        return;
+    s->response.bytes += len;
+    s->response.hash = capture_hash(s->response.hash, data, len);
+
+    const char *p = data;
+    for (size_t i = 0; i < len && !s->line_done; i++) {
+        if (p[i] == '\r' || p[i] == '\n')
+            s->line_done = 1;
+        else if (s->line_len < CAPTURE_LINE_SIZE)
+            s->line[s->line_len++] = p[i];
+    }
+}
+
+/** Records the end of a session and frees its capture state (does
+ *  nothing if s is NULL). Call before the socket is closed.
+ */
+void capture_close(capture_session *s) {
+    if (!s)
+        return;
+    finish_response(s);
+    record(s, CAP_CLOSE, NULL, 0, NULL, 0);
+    sessions_by_fd[s->fd] = NULL;
+    free(s);
+}
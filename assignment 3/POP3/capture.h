@@ -0,0 +1,55 @@
+/* capture.h
+ * Recording of POP3 sessions for later replay (see popreplay.c).
+ *
+ * A capture file starts with CAPTURE_MAGIC, followed by records, each
+ * a capture_record header and then length bytes of data (in the byte
+ * order of the capturing machine). The records of a session are in
+ * order; records of different sessions are interleaved in time order.
+ *
+ *   CAP_OPEN      A session started. No data.
+ *   CAP_COMMAND   A command line, as received (including the line
+ *                 end). PASS lines hold the password in clear, so the
+ *                 file is only readable by its owner.
+ *   CAP_RESPONSE  The response to the session's previous command: a
+ *                 capture_response, then its first line (without the
+ *                 line end, cut at CAPTURE_LINE_SIZE bytes).
+ *   CAP_CLOSE     The session ended. No data.
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC     "POPCAP1\n"
+#define CAPTURE_LINE_SIZE 120
+
+enum capture_type { CAP_OPEN = 1, CAP_COMMAND, CAP_RESPONSE, CAP_CLOSE };
+
+typedef struct capture_record {
+    uint64_t session;
+    uint64_t time_us;           // Since the capture started
+    uint32_t length;            // Bytes of data after this header
+    uint8_t type;
+    uint8_t pad[3];
+} capture_record;
+
+typedef struct capture_response {
+    uint64_t bytes;             // Length of the whole response
+    uint64_t hash;              // capture_hash() of the whole response
+} capture_response;
+
+typedef struct capture_session capture_session;
+
+#define CAPTURE_HASH_INIT 0xcbf29ce484222325ULL
+
+uint64_t         capture_hash(uint64_t hash, const void *data, size_t len);
+
+int              capture_start(const char *path);
+capture_session *capture_open(int fd);
+void             capture_command(capture_session *s, const char *line, size_t len);
+void             capture_sent(int fd, const void *data, size_t len);
+void             capture_close(capture_session *s);
+
+#endif
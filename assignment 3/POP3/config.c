@@ -0,0 +1,183 @@
+/* config.c
+ * mypopd configuration file.
+ */
+
+#include "config.h"
+#include "mailstore.h"
+#include "userdb.h"
+#include "mailcache.h"
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/** Fills in the settings used when neither the configuration file nor
+ *  the command line sets them.
+ */
+void config_defaults(server_config *config) {
+    memset(config, 0, sizeof(*config));
+    config->backlog = DEFAULT_BACKLOG;
+    config->accept_batch = DEFAULT_ACCEPT_BATCH;
+    config->verbose = 1;
+    strcpy(config->users_file, USER_FILE_NAME);
+    strcpy(config->mail_store, MAIL_BASE_DIRECTORY);
+    config->warm_budget = MAILCACHE_DEFAULT_BUDGET;
+}
+
+/* Parses a whole number between min and max. */
+static int set_number(long *field, const char *value, long min, long max) {
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (!*value || *end || number < min || number > max)
+        return -1;
+    *field = number;
+    return 0;
+}
+
+static int set_string(char *field, size_t size, const char *value) {
+    if (strlen(value) >= size)
+        return -1;
+    strcpy(field, value);
+    return 0;
+}
+
+/* Applies a single setting. Returns -1 if the key is unknown or the
+ * value invalid. */
+static int config_set(server_config *config, const char *key, const char *value) {
+    if (!strcmp(key, "address"))
+        return set_string(config->address, sizeof(config->address), value);
+    if (!strcmp(key, "port"))
+        return set_string(config->port, sizeof(config->port), value);
+    if (!strcmp(key, "mail_store"))
+        return set_string(config->mail_store, sizeof(config->mail_store), value);
+    if (!strcmp(key, "admin_socket"))
+        return set_string(config->admin_socket, sizeof(config->admin_socket), value);
+    if (!strcmp(key, "handoff_socket"))
+        return set_string(config->handoff_socket, sizeof(config->handoff_socket), value);
+    if (!strcmp(key, "capture_file"))
+        return set_string(config->capture_file, sizeof(config->capture_file), value);
+    if (!strcmp(key, "users_file"))
+        return set_string(config->users_file, sizeof(config->users_file), value);
+    long number;
+    if (!strcmp(key, "backlog")) {
+        if (set_number(&number, value, 1, 65535) < 0)
+            return -1;
+        config->backlog = number;
+        return 0;
+    }
+    if (!strcmp(key, "fastopen")) {
+        if (set_number(&number, value, 0, 65535) < 0)
+            return -1;
+        config->fastopen = number;
+        return 0;
+    }
+    if (!strcmp(key, "accept_batch")) {
+        if (set_number(&number, value, 1, 65535) < 0)
+            return -1;
+        config->accept_batch = number;
+        return 0;
+    }
+    if (!strcmp(key, "workers")) {
+        if (set_number(&number, value, 0, 1024) < 0)
+            return -1;
+        config->workers = number;
+        return 0;
+    }
+    if (!strcmp(key, "warm_threads")) {
+        if (set_number(&number, value, 0, 256) < 0)
+            return -1;
+        config->warm_threads = number;
+        return 0;
+    }
+    if (!strcmp(key, "warm_budget")) {
+        if (set_number(&number, value, 1, 1024 * 1024) < 0)
+            return -1;
+        config->warm_budget = (size_t) number * 1024 * 1024;
+        return 0;
+    }
+    if (!strcmp(key, "warm_recent")) {
+        if (set_number(&number, value, 0, 1000000) < 0)
+            return -1;
+        config->warm_recent = number;
+        return 0;
+    }
+    if (!strcmp(key, "connection_rate"))
+        return ratelimit_parse(value, &config->connections);
+    if (!strcmp(key, "auth_failure_rate"))
+        return ratelimit_parse(value, &config->auth_failures);
+    if (!strcmp(key, "pin_cpus")) {
+        if (!strcmp(value, "yes"))
+            config->pin_cpus = 1;
+        else if (!strcmp(value, "no"))
+            config->pin_cpus = 0;
+        else
+            return -1;
+        return 0;
+    }
+    if (!strcmp(key, "log_level")) {
+        if (!strcmp(value, "quiet"))
+            config->verbose = 0;
+        else if (!strcmp(value, "verbose"))
+            config->verbose = 1;
+        else
+            return -1;
+        return 0;
+    }
+    return -1;
+}
+
+/** Reads a configuration file over the given settings; settings the
+ *  file does not mention keep their value. Nothing is changed if the
+ *  file has any error.
+ *
+ *  Parameters: path: Configuration file.
+ *              config: Settings to be updated.
+ *
+ *  Returns: 0 on success, -1 (after printing the reason to stderr) if
+ *           the file cannot be read or has an invalid line.
+ */
+int config_load(const char *path, server_config *config) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    server_config next = *config;
+    char line[PATH_MAX + 64];
+    int lineno = 0, rv = 0;
+    while (fgets(line, sizeof(line), file)) {
+        lineno++;
+        char *p = strchr(line, '#');
+        if (p)
+            *p = 0;
+        char *end = line + strlen(line);
+        while (end > line && isspace((unsigned char) end[-1]))
+            *--end = 0;
+
+        char *key = line;
+        while (isspace((unsigned char) *key))
+            key++;
+        if (!*key)
+            continue;
+        p = key;
+        while (*p && !isspace((unsigned char) *p) && *p != '=')
+            p++;
+        char *value = p;
+        while (isspace((unsigned char) *value) || *value == '=')
+            value++;
+        *p = 0;
+
+        if (config_set(&next, key, value) < 0) {
+            fprintf(stderr, "%s:%d: invalid setting '%s'\n", path, lineno, key);
+            rv = -1;
+        }
+    }
+    fclose(file);
+
+    if (rv == 0)
+        *config = next;
+    return rv;
+}
@@ -0,0 +1,39 @@
+/* config.h
+ * mypopd configuration file: one "key = value" setting per line, with
+ * '#' starting a comment. See mypopd.conf for the available keys.
+ */
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include <limits.h>
+
+#include "ratelimit.h"
+
+typedef struct server_config {
+    // Applied at startup only
+    char address[256];          // Empty to listen on all interfaces
+    char port[32];
+    char mail_store[PATH_MAX];
+    char admin_socket[108];     // Empty for none
+    char handoff_socket[108];   // Empty for none
+    char capture_file[PATH_MAX];  // Empty for no capture
+    int warm_threads;           // Maildrop cache scanner threads, 0 for no warm-up
+    size_t warm_budget;         // Bytes
+    int warm_recent;            // Messages read ahead per maildrop
+    int pin_cpus;
+    int fastopen;               // TCP Fast Open queue length, 0 for off
+    int accept_batch;
+    int workers;                // Worker processes, 0 to serve in one process
+    // Applied again on every reload
+    int backlog;
+    rate_limit connections;
+    rate_limit auth_failures;
+    int verbose;
+    char users_file[PATH_MAX];
+} server_config;
+
+void config_defaults(server_config *config);
+int  config_load(const char *path, server_config *config);
+
+#endif
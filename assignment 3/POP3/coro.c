@@ -0,0 +1,646 @@
+/* coro.c
+ * Stackful coroutines multiplexed over a few worker threads.
+ *
+ * Each worker thread owns an epoll instance and a run queue. A new
+ * coroutine is handed to a worker (round-robin) through a small
+ * locked inbox and an eventfd; from then on it only ever runs on that
+ * worker, so thread-local data seen by the coroutine stays the
+ * worker's. Context switches use ucontext.
+ *
+ * Coroutine stacks are mmap'd with a PROT_NONE guard page below them,
+ * so an overflow faults instead of silently corrupting a neighbour.
+ * Finished coroutines keep their stack in a per-worker cache for the
+ * next session.
+ *
+ * coro_recv() and coro_send() behave like recv() and send() on a
+ * blocking socket. Inside a coroutine (where sockets are expected to
+ * be non-blocking) they park the coroutine until the socket is ready;
+ * elsewhere they simply call recv() and send().
+ *
+ * With CORO_IO_URING, workers wait on an io_uring instead of epoll,
+ * and socket and file operations are io_uring requests: a coroutine
+ * queues its request and parks, and the worker submits everything its
+ * coroutines queued with a single io_uring_enter() once none of them
+ * can run, which also collects the completions. Each worker registers
+ * a pool of I/O buffers (see coro_buffer_get()) so that reads into
+ * them use IORING_OP_READ_FIXED. If io_uring is not available, the
+ * runtime falls back to epoll.
+ *
+ * With CORO_PIN_CPUS, each worker is pinned to a CPU of its own, and
+ * its I/O buffers are placed on that CPU's NUMA node (its coroutine
+ * stacks are too, being first touched by the worker).
+ * coro_spawn_on() then hands a coroutine to the worker of a given
+ * CPU, such as the one that received a connection's packets.
+ */
+
+#define _GNU_SOURCE
+
+#include "coro.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "uring.h"
+#include "topology.h"
+
+#define MAX_EVENTS         64
+#define MAX_CACHED_STACKS  256
+#define URING_ENTRIES      256
+#define WORKER_BUFFERS     64
+
+struct coro {
+    ucontext_t ctx;
+    void (*fn)(void *);
+    void *arg;
+    struct worker *worker;
+    char *mapping;          // Guard page followed by the stack
+    int fd;                 // Descriptor registered with the worker's epoll
+    int result;             // Result of the last io_uring request
+    int done;
+    struct coro *next;
+};
+
+struct worker {
+    pthread_t thread;
+    int epfd;
+    int wakefd;
+    ucontext_t scheduler;
+    struct coro *run_head, *run_tail;
+    struct coro *spare;     // Finished coroutines whose stacks can be reused
+    int spare_count;
+    pthread_mutex_t inbox_lock;
+    struct coro *inbox;
+    int use_uring;
+    uring ring;
+    uint64_t wake_value;    // Target of the pending read of wakefd
+    char *buffers;          // WORKER_BUFFERS I/O buffers, registered with the ring
+    int buffers_registered;
+    void *free_buffers;     // Free buffers, linked through their first word
+    int cpu;                // CPU the worker is pinned to, or -1
+};
+
+static struct worker *workers;
+static int worker_count;
+static size_t stack_size;
+static size_t page_size;
+static unsigned int next_worker;
+
+static __thread struct coro *current;
+
+static void run_queue_push(struct worker *w, struct coro *c) {
+    c->next = NULL;
+    if (w->run_tail)
+        w->run_tail->next = c;
+    else
+        w->run_head = c;
+    w->run_tail = c;
+}
+
+static struct coro *run_queue_pop(struct worker *w) {
+    struct coro *c = w->run_head;
+    if (c) {
+        w->run_head = c->next;
+        if (!w->run_head)
+            w->run_tail = NULL;
+    }
+    return c;
+}
+
+static void coro_entry(void) {
+    struct coro *c = current;
+    c->fn(c->arg);
+    c->done = 1;
+    // Returning switches to uc_link, i.e., back to the scheduler.
+}
+
+/* Gives a coroutine a stack and an initial context. Returns -1 if no
+ * stack can be mapped. */
+static int coro_prepare(struct worker *w, struct coro *c) {
+    struct coro *spare = w->spare;
+    if (spare) {
+        w->spare = spare->next;
+        w->spare_count--;
+        c->mapping = spare->mapping;
+        free(spare);
+    } else {
+        c->mapping = mmap(NULL, page_size + stack_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (c->mapping == MAP_FAILED)
+            return -1;
+        mprotect(c->mapping, page_size, PROT_NONE);
+    }
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = c->mapping + page_size;
+    c->ctx.uc_stack.ss_size = stack_size;
+    c->ctx.uc_link = &w->scheduler;
+    makecontext(&c->ctx, coro_entry, 0);
+    c->worker = w;
+    c->fd = -1;
+    c->done = 0;
+    return 0;
+}
+
+static void coro_finish(struct worker *w, struct coro *c) {
+    if (w->spare_count < MAX_CACHED_STACKS) {
+        c->next = w->spare;
+        w->spare = c;
+        w->spare_count++;
+    } else {
+        munmap(c->mapping, page_size + stack_size);
+        free(c);
+    }
+}
+
+/* Moves coroutines handed over by other threads to the run queue. The
+ * caller has already consumed the wakeup. */
+static void drain_inbox(struct worker *w) {
+    pthread_mutex_lock(&w->inbox_lock);
+    struct coro *list = w->inbox;
+    w->inbox = NULL;
+    pthread_mutex_unlock(&w->inbox_lock);
+
+    // The inbox is a stack; reverse it so sessions start in order.
+    struct coro *ordered = NULL;
+    while (list) {
+        struct coro *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while (ordered) {
+        struct coro *next = ordered->next;
+        if (coro_prepare(w, ordered) == 0)
+            run_queue_push(w, ordered);
+        else {
+            perror("coroutine stack");
+            free(ordered);
+        }
+        ordered = next;
+    }
+}
+
+/* Returns a submission entry of the worker's ring, submitting what is
+ * pending first if the queue is full. */
+static struct io_uring_sqe *worker_sqe(struct worker *w) {
+    struct io_uring_sqe *sqe;
+    while ((sqe = uring_get_sqe(&w->ring)) == NULL)
+        uring_submit(&w->ring, 0);
+    return sqe;
+}
+
+/* Queues a read of the wakeup eventfd; its completion (user_data 0)
+ * means other threads have handed over coroutines. */
+static void uring_arm_wakeup(struct worker *w) {
+    struct io_uring_sqe *sqe = worker_sqe(w);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = w->wakefd;
+    sqe->addr = (uintptr_t) &w->wake_value;
+    sqe->len = sizeof(w->wake_value);
+    sqe->user_data = 0;
+}
+
+/* Queues a request for the running coroutine and parks it until the
+ * request completes. Returns the result (a negative errno on error). */
+static int uring_park(struct coro *c, struct io_uring_sqe *sqe) {
+    sqe->user_data = (uintptr_t) c;
+    swapcontext(&c->ctx, &c->worker->scheduler);
+    return c->result;
+}
+
+static int uring_result(int res) {
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+static int uring_poll(struct coro *c, int fd, int events) {
+    struct io_uring_sqe *sqe = worker_sqe(c->worker);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    return uring_park(c, sqe);
+}
+
+/* Waits for ready coroutines: fd events with epoll, or completions
+ * (after submitting every queued request) with io_uring. */
+static void worker_wait(struct worker *w) {
+    if (w->use_uring) {
+        uring_submit(&w->ring, 1);
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&w->ring)) != NULL) {
+            struct coro *c = (struct coro *) (uintptr_t) cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(&w->ring);
+            if (c) {
+                c->result = res;
+                run_queue_push(w, c);
+            } else {
+                drain_inbox(w);
+                uring_arm_wakeup(w);
+            }
+        }
+        return;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr == NULL) {
+            if (read(w->wakefd, &w->wake_value, sizeof(w->wake_value)) < 0 && errno != EAGAIN)
+                perror("coroutine wakeup");
+            drain_inbox(w);
+        } else
+            run_queue_push(w, events[i].data.ptr);
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+
+    if (w->use_uring)
+        uring_arm_wakeup(w);
+    while (1) {
+        struct coro *c;
+        while ((c = run_queue_pop(w)) != NULL) {
+            current = c;
+            swapcontext(&w->scheduler, &c->ctx);
+            current = NULL;
+            if (c->done)
+                coro_finish(w, c);
+        }
+        worker_wait(w);
+    }
+    return NULL;
+}
+
+/* Sets up a worker's ring and its registered buffers. */
+static int worker_uring_init(struct worker *w) {
+    if (uring_init(&w->ring, URING_ENTRIES) < 0)
+        return -1;
+    w->buffers = mmap(NULL, (size_t) WORKER_BUFFERS * CORO_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (w->buffers == MAP_FAILED) {
+        w->buffers = NULL;
+        uring_destroy(&w->ring);
+        return -1;
+    }
+    // The buffers are touched here, on the starting thread, so they
+    // are placed on the worker's node explicitly.
+    if (w->cpu >= 0)
+        topo_prefer_node(w->buffers, (size_t) WORKER_BUFFERS * CORO_BUFFER_SIZE,
+                         topo_node_of_cpu(w->cpu));
+
+    struct iovec iov[WORKER_BUFFERS];
+    for (int i = WORKER_BUFFERS - 1; i >= 0; i--) {
+        char *buf = w->buffers + (size_t) i * CORO_BUFFER_SIZE;
+        iov[i].iov_base = buf;
+        iov[i].iov_len = CORO_BUFFER_SIZE;
+        *(void **) buf = w->free_buffers;
+        w->free_buffers = buf;
+    }
+    // Unregistered buffers still work, only without READ_FIXED (e.g.,
+    // when RLIMIT_MEMLOCK is too low to pin them).
+    w->buffers_registered = uring_register_buffers(&w->ring, iov, WORKER_BUFFERS) == 0;
+    w->use_uring = 1;
+    return 0;
+}
+
+static void worker_uring_destroy(struct worker *w) {
+    if (!w->use_uring)
+        return;
+    uring_destroy(&w->ring);
+    munmap(w->buffers, (size_t) WORKER_BUFFERS * CORO_BUFFER_SIZE);
+    w->buffers = NULL;
+    w->free_buffers = NULL;
+    w->use_uring = 0;
+}
+
+/** Starts the worker threads that run coroutines.
+ *
+ *  Parameters: threads: Number of worker threads.
+ *              size: Usable stack size of each coroutine, in bytes
+ *                    (rounded up to whole pages).
+ *              flags: CORO_IO_URING to perform I/O through io_uring
+ *                     (falls back to epoll, with a warning, if
+ *                     io_uring cannot be set up), CORO_PIN_CPUS to pin
+ *                     worker i to the i-th CPU the process may use, or
+ *                     0.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int coro_runtime_start(int threads, size_t size, int flags) {
+    page_size = sysconf(_SC_PAGESIZE);
+    stack_size = (size + page_size - 1) / page_size * page_size;
+    worker_count = threads;
+    workers = calloc(threads, sizeof(struct worker));
+    if (!workers)
+        return -1;
+    for (int i = 0; i < threads; i++)
+        workers[i].cpu = flags & CORO_PIN_CPUS ? topo_cpu(i) : -1;
+
+    // Sockets are blocking with io_uring and non-blocking with epoll,
+    // so all workers must use the same backend.
+    if (flags & CORO_IO_URING) {
+        for (int i = 0; i < threads; i++) {
+            if (worker_uring_init(&workers[i]) < 0) {
+                perror("io_uring unavailable, using epoll");
+                for (int j = 0; j < i; j++)
+                    worker_uring_destroy(&workers[j]);
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < threads; i++) {
+        struct worker *w = &workers[i];
+        pthread_mutex_init(&w->inbox_lock, NULL);
+        if (w->use_uring) {
+            // Read through the ring, which must not see EAGAIN.
+            w->wakefd = eventfd(0, EFD_CLOEXEC);
+            if (w->wakefd < 0)
+                return -1;
+        } else {
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+            w->epfd = epoll_create1(EPOLL_CLOEXEC);
+            w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (w->epfd < 0 || w->wakefd < 0 ||
+                epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev) < 0)
+                return -1;
+        }
+        // A pinned worker starts out on its CPU, so that everything it
+        // touches first lands on the CPU's node.
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (w->cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(w->cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        int rv = pthread_create(&w->thread, &attr, worker_main, w);
+        pthread_attr_destroy(&attr);
+        if (rv != 0)
+            return -1;
+        pthread_detach(w->thread);
+    }
+    return 0;
+}
+
+/* Hands a new coroutine running fn(arg) to a worker. */
+static int spawn_on_worker(struct worker *w, void (*fn)(void *), void *arg) {
+    struct coro *c = calloc(1, sizeof(*c));
+    if (!c)
+        return -1;
+    c->fn = fn;
+    c->arg = arg;
+
+    pthread_mutex_lock(&w->inbox_lock);
+    int was_empty = w->inbox == NULL;
+    c->next = w->inbox;
+    w->inbox = c;
+    pthread_mutex_unlock(&w->inbox_lock);
+
+    // A worker with a non-empty inbox has already been woken up.
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(w->wakefd, &one, sizeof(one)) < 0)
+            perror("coroutine wakeup");
+    }
+    return 0;
+}
+
+/** Creates a coroutine that runs fn(arg) on one of the workers. May
+ *  be called from any thread.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int coro_spawn(void (*fn)(void *), void *arg) {
+    return spawn_on_worker(&workers[__atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % worker_count],
+                           fn, arg);
+}
+
+/** Like coro_spawn(), but prefers the worker pinned to the given CPU,
+ *  then the workers on the CPU's NUMA node, and otherwise picks any
+ *  worker (as does a runtime whose workers are not pinned).
+ */
+int coro_spawn_on(int cpu, void (*fn)(void *), void *arg) {
+    if (cpu >= 0 && workers[0].cpu >= 0) {
+        int node = topo_node_of_cpu(cpu);
+        unsigned int start = __atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED);
+        struct worker *same_node = NULL;
+        for (int i = 0; i < worker_count; i++) {
+            struct worker *w = &workers[(start + i) % worker_count];
+            if (w->cpu == cpu)
+                return spawn_on_worker(w, fn, arg);
+            if (!same_node && topo_node_of_cpu(w->cpu) == node)
+                same_node = w;
+        }
+        if (same_node)
+            return spawn_on_worker(same_node, fn, arg);
+    }
+    return coro_spawn(fn, arg);
+}
+
+/** Returns the running coroutine, or NULL if the caller is not
+ *  running in a coroutine.
+ */
+coro_t coro_current(void) {
+    return current;
+}
+
+/** Lets the other ready coroutines of this worker run before
+ *  continuing. Does nothing outside a coroutine.
+ */
+void coro_yield(void) {
+    struct coro *c = current;
+    if (!c)
+        return;
+    run_queue_push(c->worker, c);
+    swapcontext(&c->ctx, &c->worker->scheduler);
+}
+
+/** Parks the running coroutine until fd reports one of the given
+ *  epoll events. Outside a coroutine, blocks the thread in poll().
+ *
+ *  Returns: 0 once the descriptor is ready, -1 on error.
+ */
+int coro_wait_fd(int fd, int events) {
+    struct coro *c = current;
+    if (!c) {
+        struct pollfd pfd = { fd, events, 0 };
+        return poll(&pfd, 1, -1) < 0 ? -1 : 0;
+    }
+    if (c->worker->use_uring)
+        return uring_result(uring_poll(c, fd, events)) < 0 ? -1 : 0;
+
+    struct epoll_event ev = { .events = events | EPOLLONESHOT, .data.ptr = c };
+    int epfd = c->worker->epfd;
+    if (c->fd == fd) {
+        // The registration disappears if the descriptor was closed
+        // and its number reused since.
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0 &&
+            (errno != ENOENT || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0))
+            return -1;
+    } else {
+        if (c->fd >= 0)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return -1;
+        c->fd = fd;
+    }
+    swapcontext(&c->ctx, &c->worker->scheduler);
+    return 0;
+}
+
+/** Receives data like recv(); inside a coroutine, waits for data
+ *  instead of failing with EAGAIN.
+ */
+ssize_t coro_recv(int fd, void *buf, size_t len, int flags) {
+    struct coro *c = current;
+    if (c && c->worker->use_uring) {
+        int res;
+        do {
+            struct io_uring_sqe *sqe = worker_sqe(c->worker);
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t) buf;
+            sqe->len = len;
+            sqe->msg_flags = flags;
+            res = uring_park(c, sqe);
+        } while (res == -EINTR || (res == -EAGAIN && uring_poll(c, fd, POLLIN) >= 0));
+        return uring_result(res);
+    }
+
+    while (1) {
+        ssize_t rv = recv(fd, buf, len, flags);
+        if (rv >= 0)
+            return rv;
+        if (errno == EINTR)
+            continue;
+        if (!c || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+            coro_wait_fd(fd, EPOLLIN | EPOLLRDHUP) < 0)
+            return rv;
+    }
+}
+
+/** Sends data like send(); inside a coroutine, waits for buffer space
+ *  instead of failing with EAGAIN. May send only part of the data,
+ *  like send().
+ */
+ssize_t coro_send(int fd, const void *buf, size_t len, int flags) {
+    struct coro *c = current;
+    if (c && c->worker->use_uring) {
+        int res;
+        do {
+            struct io_uring_sqe *sqe = worker_sqe(c->worker);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t) buf;
+            sqe->len = len;
+            sqe->msg_flags = flags;
+            res = uring_park(c, sqe);
+        } while (res == -EINTR || (res == -EAGAIN && uring_poll(c, fd, POLLOUT) >= 0));
+        return uring_result(res);
+    }
+
+    while (1) {
+        ssize_t rv = send(fd, buf, len, flags);
+        if (rv >= 0)
+            return rv;
+        if (errno == EINTR)
+            continue;
+        if (!c || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+            coro_wait_fd(fd, EPOLLOUT) < 0)
+            return rv;
+    }
+}
+
+/** Returns the flags that make a socket suited to coro_recv() and
+ *  coro_send() with the runtime's backend, for accept4() or socket():
+ *  SOCK_NONBLOCK with epoll, none with io_uring, where a blocking
+ *  socket lets the ring wait instead of failing with EAGAIN.
+ */
+int coro_socket_flags(void) {
+    return workers && workers[0].use_uring ? 0 : SOCK_NONBLOCK;
+}
+
+/** Opens a file like open() (read-only or without O_CREAT).
+ */
+int coro_open(const char *path, int flags) {
+    struct coro *c = current;
+    if (!c || !c->worker->use_uring)
+        return open(path, flags);
+
+    struct io_uring_sqe *sqe = worker_sqe(c->worker);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) path;
+    sqe->open_flags = flags;
+    return uring_result(uring_park(c, sqe));
+}
+
+/** Reads from a file at the given offset, like pread(). Reads into a
+ *  buffer from coro_buffer_get() use the worker's registered buffers.
+ */
+ssize_t coro_read(int fd, void *buf, size_t len, off_t offset) {
+    struct coro *c = current;
+    if (!c || !c->worker->use_uring)
+        return pread(fd, buf, len, offset);
+
+    struct worker *w = c->worker;
+    struct io_uring_sqe *sqe = worker_sqe(w);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    char *p = buf;
+    if (w->buffers_registered && p >= w->buffers &&
+        p + len <= w->buffers + (size_t) WORKER_BUFFERS * CORO_BUFFER_SIZE) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = (p - w->buffers) / CORO_BUFFER_SIZE;
+    }
+    return uring_result(uring_park(c, sqe));
+}
+
+/** Returns a buffer of CORO_BUFFER_SIZE bytes for file or socket I/O,
+ *  taken from the worker's registered pool when possible. Release it
+ *  with coro_buffer_put() from the same coroutine.
+ *
+ *  Returns: the buffer, or NULL if out of memory.
+ */
+void *coro_buffer_get(void) {
+    struct coro *c = current;
+    if (c && c->worker->free_buffers) {
+        void *buf = c->worker->free_buffers;
+        c->worker->free_buffers = *(void **) buf;
+        return buf;
+    }
+    return malloc(CORO_BUFFER_SIZE);
+}
+
+void coro_buffer_put(void *buf) {
+    struct coro *c = current;
+    char *p = buf;
+    if (c && c->worker->buffers && p >= c->worker->buffers &&
+        p < c->worker->buffers + (size_t) WORKER_BUFFERS * CORO_BUFFER_SIZE) {
+        *(void **) buf = c->worker->free_buffers;
+        c->worker->free_buffers = buf;
+    } else
+        free(buf);
+}
@@ -0,0 +1,40 @@
+/* coro.h
+ * Stackful coroutines multiplexed over a few worker threads. Code
+ * running in a coroutine is written as ordinary blocking code; when a
+ * socket operation would block, the coroutine is parked until the
+ * socket is ready and the worker runs other coroutines meanwhile.
+ */
+
+#ifndef _CORO_H_
+#define _CORO_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define CORO_DEFAULT_STACK_SIZE (64 * 1024)
+#define CORO_BUFFER_SIZE        (16 * 1024)
+
+// coro_runtime_start() flags
+#define CORO_IO_URING 1
+#define CORO_PIN_CPUS 2
+
+typedef struct coro *coro_t;
+
+int     coro_runtime_start(int threads, size_t stack_size, int flags);
+int     coro_spawn(void (*fn)(void *), void *arg);
+int     coro_spawn_on(int cpu, void (*fn)(void *), void *arg);
+coro_t  coro_current(void);
+void    coro_yield(void);
+int     coro_wait_fd(int fd, int events);
+
+ssize_t coro_recv(int fd, void *buf, size_t len, int flags);
+ssize_t coro_send(int fd, const void *buf, size_t len, int flags);
+int     coro_socket_flags(void);
+int     coro_open(const char *path, int flags);
+ssize_t coro_read(int fd, void *buf, size_t len, off_t offset);
+
+void   *coro_buffer_get(void);
+void    coro_buffer_put(void *buf);
+
+#endif
@@ -0,0 +1,138 @@
+/* handoff.c
+ * Listening socket handoff.
+ *
+ * A server started with a handoff socket path listens on it for its
+ * successor. The successor connects, receives the listening socket as
+ * SCM_RIGHTS ancillary data and starts accepting on it at once; since
+ * the socket itself never closes, connections arriving meanwhile just
+ * wait in its queue. The successor then takes over the path for the
+ * next upgrade.
+ */
+
+#include "handoff.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int handoff_address(const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/** Asks the server listening on a handoff socket for its listening
+ *  socket. The server stops accepting once it has sent it.
+ *
+ *  Parameters: path: Handoff socket of the running server.
+ *
+ *  Returns: The listening socket, or -1 if no server answers on path.
+ */
+int handoff_receive(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_address(path, &addr) < 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    char byte;
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+
+    ssize_t n;
+    do
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    while (n < 0 && errno == EINTR);
+    close(fd);
+
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        return -1;
+    int listen_fd;
+    memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+    return listen_fd;
+}
+
+/** Creates the handoff socket a successor connects to, replacing any
+ *  socket file left at path.
+ *
+ *  Returns: The handoff socket, or -1 on error.
+ */
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_address(path, &addr) < 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** Waits for a successor on a handoff socket and sends it the
+ *  listening socket.
+ *
+ *  Parameters: handoff_fd: Socket returned by handoff_listen().
+ *              listen_fd: Listening socket to pass on.
+ *
+ *  Returns: 0 once a successor has the socket, -1 on error.
+ */
+int handoff_send(int handoff_fd, int listen_fd) {
+    int fd;
+    do
+        fd = accept(handoff_fd, NULL, NULL);
+    while (fd < 0 && errno == EINTR);
+    if (fd < 0)
+        return -1;
+
+    char byte = 0;
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+    ssize_t n;
+    do
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    while (n < 0 && errno == EINTR);
+    close(fd);
+    return n == 1 ? 0 : -1;
+}
@@ -0,0 +1,14 @@
+/* handoff.h
+ * Passing the listening socket from a running server to its
+ * replacement over a Unix domain socket, so that an upgrade never
+ * refuses a connection.
+ */
+
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+int handoff_receive(const char *path);
+int handoff_listen(const char *path);
+int handoff_send(int handoff_fd, int listen_fd);
+
+#endif
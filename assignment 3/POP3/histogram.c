@@ -0,0 +1,78 @@
+/* histogram.c
+ * Log-linear (HDR-style) histogram of latencies or sizes.
+ */
+
+#include "histogram.h"
+
+#include <string.h>
+
+/* Values below HIST_SUB have a bucket each. Above that, the bucket is
+ * given by the position of the most significant bit and the
+ * HIST_SUB_BITS bits that follow it. */
+static int hist_index(uint64_t value) {
+    if (value >= HIST_MAX)
+        value = HIST_MAX - 1;
+    if (value < HIST_SUB)
+        return value;
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int) ((value >> shift) - HIST_SUB);
+}
+
+/* Highest value that falls in a bucket. */
+static uint64_t hist_value(int index) {
+    if (index < HIST_SUB)
+        return index;
+    int shift = index / HIST_SUB - 1;
+    uint64_t sub = index % HIST_SUB;
+    return ((HIST_SUB + sub + 1) << shift) - 1;
+}
+
+/** Clears all values recorded in a histogram.
+ */
+void hist_reset(histogram *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+/** Records one value. Values of HIST_MAX or more are counted in the
+ *  last bucket, but still update the maximum.
+ */
+void hist_record(histogram *h, uint64_t value) {
+    h->buckets[hist_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max)
+        h->max = value;
+}
+
+/** Adds all values recorded in src to dst.
+ */
+void hist_merge(histogram *dst, const histogram *src) {
+    if (!src->count)
+        return;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/** Returns the value below which the given percentage (0 to 100) of
+ *  the recorded values fall, or 0 if nothing was recorded.
+ */
+uint64_t hist_percentile(const histogram *h, double percentile) {
+    if (!h->count)
+        return 0;
+    uint64_t target = (uint64_t) (h->count * percentile / 100.0 + 0.5);
+    if (target < 1)
+        target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            uint64_t value = hist_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,31 @@
+/* histogram.h
+ * Log-linear (HDR-style) histogram of latencies or sizes. Values are
+ * grouped in buckets whose width doubles with every power of two, with
+ * HIST_SUB buckets per power of two, so any recorded value is known
+ * within about 3% while the whole histogram stays a fixed, small size.
+ */
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BITS     32
+#define HIST_MAX      ((uint64_t) 1 << HIST_BITS)
+#define HIST_BUCKETS  ((HIST_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[HIST_BUCKETS];
+} histogram;
+
+void     hist_reset(histogram *h);
+void     hist_record(histogram *h, uint64_t value);
+void     hist_merge(histogram *dst, const histogram *src);
+uint64_t hist_percentile(const histogram *h, double percentile);
+
+#endif
@@ -0,0 +1,303 @@
+/* mailcache.c
+ * Warm-start maildrop cache.
+ *
+ * At startup, a pool of scanner threads walks the users file and loads
+ * the listing of every maildrop while the server is already accepting
+ * connections. Optionally, the most recent messages of each maildrop
+ * are read ahead into the page cache too. Loading stops once the
+ * listings (and messages read ahead) reach the memory budget.
+ *
+ * A cached listing is handed out once, to the first login of its
+ * user, and only if none of the directories it was read from changed
+ * since: a delivery or deletion changes the directory holding the
+ * file. Later logins scan the maildrop as usual, by then from warm
+ * kernel caches. A directory changed within a second of being read
+ * could change again without its timestamp moving, so maildrops with
+ * such directories are not cached.
+ */
+
+#include "mailcache.h"
+#include "mailstore.h"
+#include "userdb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+struct dir_stamp {
+    ino_t ino;
+    struct timespec mtime;
+    char *path;
+};
+
+struct cached_maildrop {
+    unsigned int hash;
+    mail_list_t list;
+    size_t footprint;           // Bytes counted against the budget
+    size_t ndirs;
+    struct dir_stamp *dirs;
+    struct cached_maildrop *next;
+    char username[];
+};
+
+// Collects the directories read while scanning one maildrop.
+struct scan_dirs {
+    time_t started;
+    int racy;
+    size_t bytes;
+    size_t ndirs, capacity;
+    struct dir_stamp *dirs;
+};
+
+struct warm_job {
+    int threads;
+    int recent;
+    size_t budget;
+    char **users;
+    size_t nusers, capacity;
+    atomic_size_t next;
+    atomic_int full;
+    atomic_size_t maildrops, messages;
+};
+
+static struct cached_maildrop **buckets;
+static size_t nbuckets;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t used;
+
+static void stamps_free(struct dir_stamp *dirs, size_t ndirs) {
+    for (size_t i = 0; i < ndirs; i++)
+        free(dirs[i].path);
+    free(dirs);
+}
+
+static void visit_dir(const char *path, const struct stat *st, void *arg) {
+    struct scan_dirs *scan = arg;
+    if (st->st_mtim.tv_sec >= scan->started - 1)
+        scan->racy = 1;
+    if (scan->racy)
+        return;
+    if (scan->ndirs == scan->capacity) {
+        scan->capacity = scan->capacity ? 2 * scan->capacity : 4;
+        scan->dirs = realloc(scan->dirs, scan->capacity * sizeof(*scan->dirs));
+    }
+    struct dir_stamp *d = &scan->dirs[scan->ndirs++];
+    d->ino = st->st_ino;
+    d->mtime = st->st_mtim;
+    d->path = strdup(path);
+    scan->bytes += sizeof(*d) + strlen(path) + 1;
+}
+
+/* Reads the last messages of a listing ahead into the page cache.
+ * Returns the number of bytes read ahead. */
+static size_t read_ahead(mail_list_t list, int recent) {
+    int count = mail_list_length(list, 1);
+    size_t bytes = 0;
+    for (int i = count > recent ? count - recent : 0; i < count; i++) {
+        mail_item_t item = mail_list_retrieve(list, i);
+        int fd = open(mail_item_path(item), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+        bytes += mail_item_size(item);
+    }
+    return bytes;
+}
+
+/* Loads one maildrop into the cache. Returns 0, or -1 once the budget
+ * is used up. */
+static int warm_user(struct warm_job *job, const char *username) {
+    struct scan_dirs scan = { time(NULL), 0, 0, 0, 0, NULL };
+    mail_list_t list = load_user_mail_visit(username, visit_dir, &scan);
+
+    // A maildrop without a directory has nothing to check a later
+    // delivery against.
+    size_t len = strlen(username);
+    size_t footprint = sizeof(struct cached_maildrop) + len + 1 + scan.bytes +
+                       mail_list_footprint(list);
+    int cacheable = !scan.racy && scan.ndirs > 0;
+    int fits = cacheable && atomic_fetch_add(&used, footprint) + footprint <= job->budget;
+    struct cached_maildrop *entry = fits ? malloc(sizeof(*entry) + len + 1) : NULL;
+    if (!entry) {
+        if (cacheable)
+            atomic_fetch_sub(&used, footprint);
+        stamps_free(scan.dirs, scan.ndirs);
+        mail_list_destroy(list);
+        return cacheable && !fits ? -1 : 0;
+    }
+
+    entry->hash = mail_hash(username);
+    entry->list = list;
+    entry->footprint = footprint;
+    entry->ndirs = scan.ndirs;
+    entry->dirs = scan.dirs;
+    memcpy(entry->username, username, len + 1);
+    atomic_fetch_add(&job->maildrops, 1);
+    atomic_fetch_add(&job->messages, mail_list_length(list, 1));
+
+    if (job->recent > 0 && atomic_load(&used) < job->budget) {
+        size_t bytes = read_ahead(list, job->recent);
+        atomic_fetch_add(&used, bytes);
+        entry->footprint += bytes;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    struct cached_maildrop **bucket = &buckets[entry->hash % nbuckets];
+    entry->next = *bucket;
+    *bucket = entry;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+static void *scanner_thread(void *arg) {
+    struct warm_job *job = arg;
+    size_t i;
+    while (!atomic_load(&job->full) && (i = atomic_fetch_add(&job->next, 1)) < job->nusers) {
+        if (warm_user(job, job->users[i]) < 0)
+            atomic_store(&job->full, 1);
+    }
+    return NULL;
+}
+
+/* Runs the scanner pool to completion and reports the result. */
+static void *warm_thread(void *arg) {
+    struct warm_job *job = arg;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t *threads = malloc(job->threads * sizeof(pthread_t));
+    int started = 0;
+    while (started < job->threads &&
+           pthread_create(&threads[started], NULL, scanner_thread, job) == 0)
+        started++;
+    if (started == 0)
+        scanner_thread(job);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Warm-up: %zu of %zu maildrops (%zu messages, %zu KB) loaded in %ld ms%s\n",
+           atomic_load(&job->maildrops), job->nusers, atomic_load(&job->messages),
+           atomic_load(&used) / 1024,
+           (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000,
+           atomic_load(&job->full) ? ", memory budget reached" : "");
+    fflush(stdout);
+
+    for (size_t i = 0; i < job->nusers; i++)
+        free(job->users[i]);
+    free(job->users);
+    free(job);
+    return NULL;
+}
+
+static void add_user(const char *username, void *arg) {
+    struct warm_job *job = arg;
+    if (job->nusers == job->capacity) {
+        job->capacity = job->capacity ? 2 * job->capacity : 64;
+        job->users = realloc(job->users, job->capacity * sizeof(char *));
+    }
+    job->users[job->nusers++] = strdup(username);
+}
+
+/** Starts loading the maildrops of all users into the cache in the
+ *  background. Must be called at most once, before sessions start.
+ *
+ *  Parameters: threads: Number of scanner threads.
+ *              budget: Memory, in bytes, the cache may use, counting
+ *                      messages read ahead.
+ *              recent: Number of most recent messages of each maildrop
+ *                      to read ahead into the page cache (0 for none).
+ *              wait: Non-zero to finish loading before returning, e.g.
+ *                    so that worker processes forked next share the
+ *                    cache.
+ *
+ *  Returns: 0 if loading started, -1 on error.
+ */
+int mailcache_warm(int threads, size_t budget, int recent, int wait) {
+    struct warm_job *job = calloc(1, sizeof(*job));
+    if (!job)
+        return -1;
+    job->threads = threads > 0 ? threads : 1;
+    job->budget = budget;
+    job->recent = recent;
+    // Users added by a later reload are not loaded.
+    userdb_foreach(add_user, job);
+
+    nbuckets = 16;
+    while (nbuckets < job->nusers)
+        nbuckets *= 2;
+    buckets = calloc(nbuckets, sizeof(*buckets));
+
+    pthread_t thread;
+    if (buckets && wait) {
+        warm_thread(job);
+        return 0;
+    }
+    if (!buckets || pthread_create(&thread, NULL, warm_thread, job) != 0) {
+        for (size_t i = 0; i < job->nusers; i++)
+            free(job->users[i]);
+        free(job->users);
+        free(job);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/* Checks that none of the directories a listing was read from has
+ * changed. */
+static int entry_current(const struct cached_maildrop *entry) {
+    struct stat st;
+    for (size_t i = 0; i < entry->ndirs; i++) {
+        const struct dir_stamp *d = &entry->dirs[i];
+        if (stat(d->path, &st) < 0 || st.st_ino != d->ino ||
+            st.st_mtim.tv_sec != d->mtime.tv_sec || st.st_mtim.tv_nsec != d->mtime.tv_nsec)
+            return 0;
+    }
+    return 1;
+}
+
+/** Takes the cached listing of a user's maildrop, if there is one and
+ *  it is still current. Either way, the cache no longer holds it.
+ *
+ *  Parameters: username: Name of the user.
+ *              list: Set to the listing, which the caller then owns as
+ *                    if returned by load_user_mail.
+ *
+ *  Returns: 1 if list was set, 0 if the maildrop must be loaded.
+ */
+int mailcache_take(const char *username, mail_list_t *list) {
+    if (!buckets)
+        return 0;
+
+    unsigned int hash = mail_hash(username);
+    pthread_mutex_lock(&cache_lock);
+    struct cached_maildrop **prev = &buckets[hash % nbuckets];
+    while (*prev && ((*prev)->hash != hash || strcasecmp((*prev)->username, username)))
+        prev = &(*prev)->next;
+    struct cached_maildrop *entry = *prev;
+    if (entry)
+        *prev = entry->next;
+    pthread_mutex_unlock(&cache_lock);
+    if (!entry)
+        return 0;
+
+    int current = entry_current(entry);
+    if (current)
+        *list = entry->list;
+    else
+        mail_list_destroy(entry->list);
+    atomic_fetch_sub(&used, entry->footprint);
+    stamps_free(entry->dirs, entry->ndirs);
+    free(entry);
+    return current;
+}
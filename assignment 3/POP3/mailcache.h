@@ -0,0 +1,18 @@
+/* mailcache.h
+ * Maildrop listings loaded ahead of the first login after a start, so
+ * that those logins do not each pay for a cold directory scan.
+ */
+
+#ifndef _MAILCACHE_H_
+#define _MAILCACHE_H_
+
+#include <stddef.h>
+
+#include "mailuser.h"
+
+#define MAILCACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+int mailcache_warm(int threads, size_t budget, int recent, int wait);
+int mailcache_take(const char *username, mail_list_t *list);
+
+#endif
@@ -0,0 +1,144 @@
+/* maillock.c
+ * Exclusive maildrop locks.
+ *
+ * Locked maildrops are recorded in a table split in stripes selected
+ * by the hash of the user name, each with its own lock, so logins for
+ * different users almost never wait for each other and each holds a
+ * stripe lock only to walk a short list. A maildrop that is already
+ * locked is refused at once rather than waited for.
+ *
+ * Optionally, the lock is also taken as an flock() on a file in the
+ * user's directory, which makes it hold across several server
+ * processes sharing one mail store.
+ */
+
+#include "maillock.h"
+#include "mailstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/file.h>
+
+#define STRIPES 64
+
+struct held_lock {
+    unsigned int hash;
+    int fd;                     // Lock file descriptor, or -1
+    struct held_lock *next;
+    char username[];
+};
+
+struct stripe {
+    pthread_mutex_t lock;
+    struct held_lock *held;
+} __attribute__ ((aligned(64)));
+
+static struct stripe stripes[STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+static int use_files;
+
+static void stripes_init(void) {
+    for (int i = 0; i < STRIPES; i++)
+        pthread_mutex_init(&stripes[i].lock, NULL);
+}
+
+/** Also locks maildrops with flock() on MAIL_LOCK_FILE in the user's
+ *  directory, for deployments where several processes serve the same
+ *  mail store. Must be called before the first maildrop_lock().
+ */
+void maildrop_lock_use_files(int enable) {
+    use_files = enable;
+}
+
+/* Takes the file lock of a maildrop. Returns the descriptor holding
+ * it, -1 if another process holds it, or -2 if the maildrop has no
+ * directory (so there is nothing to protect). */
+static int lock_file(const char *username) {
+    char path[PATH_MAX];
+    if (mail_user_dir(mail_store_layout(), mail_store_base(), username, path, sizeof(path)) < 0 ||
+        strlen(path) + sizeof("/" MAIL_LOCK_FILE) > sizeof(path))
+        return -2;
+    strcat(path, "/" MAIL_LOCK_FILE);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -2;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** Locks a user's maildrop for the calling session.
+ *
+ *  Parameters: username: Name of the user.
+ *
+ *  Returns: 0 if the lock was taken, -1 if the maildrop is already
+ *           locked by another session.
+ */
+int maildrop_lock(const char *username) {
+    pthread_once(&stripes_once, stripes_init);
+    unsigned int hash = mail_hash(username);
+    struct stripe *stripe = &stripes[hash % STRIPES];
+
+    size_t len = strlen(username);
+    struct held_lock *entry = malloc(sizeof(*entry) + len + 1);
+    if (!entry)
+        return -1;
+    entry->hash = hash;
+    entry->fd = -1;
+    memcpy(entry->username, username, len + 1);
+
+    pthread_mutex_lock(&stripe->lock);
+    for (struct held_lock *h = stripe->held; h; h = h->next) {
+        if (h->hash == hash && !strcasecmp(h->username, username)) {
+            pthread_mutex_unlock(&stripe->lock);
+            free(entry);
+            return -1;
+        }
+    }
+    entry->next = stripe->held;
+    stripe->held = entry;
+    pthread_mutex_unlock(&stripe->lock);
+
+    // The file lock is taken outside the stripe lock; the entry above
+    // already keeps other sessions of this process away.
+    if (use_files) {
+        int fd = lock_file(username);
+        if (fd == -1) {
+            maildrop_unlock(username);
+            return -1;
+        }
+        entry->fd = fd;
+    }
+    return 0;
+}
+
+/** Releases a maildrop locked with maildrop_lock().
+ */
+void maildrop_unlock(const char *username) {
+    unsigned int hash = mail_hash(username);
+    struct stripe *stripe = &stripes[hash % STRIPES];
+
+    pthread_mutex_lock(&stripe->lock);
+    struct held_lock **prev = &stripe->held;
+    while (*prev && ((*prev)->hash != hash || strcasecmp((*prev)->username, username)))
+        prev = &(*prev)->next;
+    struct held_lock *entry = *prev;
+    if (entry)
+        *prev = entry->next;
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (entry) {
+        if (entry->fd >= 0)
+            close(entry->fd);
+        free(entry);
+    }
+}
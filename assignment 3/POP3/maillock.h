@@ -0,0 +1,16 @@
+/* maillock.h
+ * Exclusive maildrop locks (RFC 1939, section 8): while a session is
+ * in the TRANSACTION state, no other session may open the same
+ * maildrop.
+ */
+
+#ifndef _MAILLOCK_H_
+#define _MAILLOCK_H_
+
+#define MAIL_LOCK_FILE ".pop3.lock"
+
+void maildrop_lock_use_files(int enable);
+int  maildrop_lock(const char *username);
+void maildrop_unlock(const char *username);
+
+#endif
@@ -0,0 +1,216 @@
+/* mailstore.c
+ * Describes the on-disk layout of the mail store: where user
+ * directories and message files live, either flat or hash-sharded.
+ *
+ * In the flat layout every user is a directory directly under the
+ * base directory, and every message is a file directly inside the
+ * user's directory. In the hashed layout, either level can be spread
+ * over two levels of hash directories, e.g.:
+ *
+ *     mail.store/3f/a0/john.doe@example.com/1c/07/12.mail
+ *
+ * The layout in use is recorded in a small file in the base
+ * directory, so the server and the migration tool always agree on it.
+ */
+
+#include "mailstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/** Computes the hash used to place a user or message name in the
+ *  sharded layout (32-bit FNV-1a). User names are compared ignoring
+ *  case, so the hash ignores case as well.
+ *
+ *  Parameters: name: Name to be hashed.
+ *
+ *  Returns: Hash value for the name.
+ */
+unsigned int mail_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    for (; *name; name++) {
+        h ^= (unsigned char) tolower((unsigned char) *name);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/** Checks that a layout can be used: each fanout is either 0 (flat)
+ *  or a power of two between 2 and MAIL_MAX_FANOUT.
+ *
+ *  Returns: non-zero (true) if the layout is valid, zero otherwise.
+ */
+int mail_layout_valid(const mail_layout *layout) {
+    unsigned int f[2] = { layout->user_fanout, layout->message_fanout };
+    for (int i = 0; i < 2; i++)
+        if (f[i] && (f[i] < 2 || f[i] > MAIL_MAX_FANOUT || (f[i] & (f[i] - 1))))
+            return 0;
+    return 1;
+}
+
+/** Reads the layout description of a mail store. A store without a
+ *  layout file (including one that does not exist yet) is flat.
+ *
+ *  Parameters: base: Base directory of the mail store.
+ *              layout: Receives the layout.
+ *
+ *  Returns: 0 on success, -1 if the layout file exists but is invalid.
+ */
+int mail_layout_read(const char *base, mail_layout *layout) {
+    char path[PATH_MAX];
+    char kind[16];
+
+    layout->user_fanout = 0;
+    layout->message_fanout = 0;
+    snprintf(path, sizeof(path), "%s/%s", base, MAIL_LAYOUT_FILE);
+    FILE *file = fopen(path, "r");
+    if (!file) return 0;
+
+    int rv = 0;
+    if (fscanf(file, "%15s", kind) != 1)
+        rv = -1;
+    else if (!strcmp(kind, "hashed")) {
+        if (fscanf(file, "%u%u", &layout->user_fanout, &layout->message_fanout) != 2 ||
+            !mail_layout_valid(layout))
+            rv = -1;
+    } else if (strcmp(kind, "flat"))
+        rv = -1;
+    fclose(file);
+    return rv;
+}
+
+/** Records the layout of a mail store in its base directory. The
+ *  file is written under a temporary name and renamed into place, so
+ *  readers never see a partial description.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int mail_layout_write(const char *base, const mail_layout *layout) {
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+
+    snprintf(path, sizeof(path), "%s/%s", base, MAIL_LAYOUT_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *file = fopen(tmp, "w");
+    if (!file) return -1;
+    if (layout->user_fanout || layout->message_fanout)
+        fprintf(file, "hashed %u %u\n", layout->user_fanout, layout->message_fanout);
+    else
+        fprintf(file, "flat\n");
+    if (fclose(file) != 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static const char *store_base = MAIL_BASE_DIRECTORY;
+static mail_layout store_layout;
+static pthread_once_t store_layout_once = PTHREAD_ONCE_INIT;
+
+/** Sets the directory of the server's mail store (MAIL_BASE_DIRECTORY
+ *  by default). Must be called before the store is first used; the
+ *  string must remain valid.
+ */
+void mail_store_set_base(const char *base) {
+    store_base = base;
+}
+
+/** Returns the directory of the server's mail store.
+ */
+const char *mail_store_base(void) {
+    return store_base;
+}
+
+static void store_layout_init(void) {
+    if (mail_layout_read(store_base, &store_layout) < 0) {
+        fprintf(stderr, "Invalid %s/%s, using flat layout\n",
+                store_base, MAIL_LAYOUT_FILE);
+        store_layout.user_fanout = store_layout.message_fanout = 0;
+    }
+}
+
+/** Returns the layout of the server's mail store. The layout file is
+ *  read only once per process.
+ */
+const mail_layout *mail_store_layout(void) {
+    pthread_once(&store_layout_once, store_layout_init);
+    return &store_layout;
+}
+
+/* Appends the two hash directory levels for name to out. */
+static int shard_path(char *out, size_t size, const char *prefix,
+                      unsigned int fanout, const char *name) {
+    int rv;
+    if (fanout) {
+        unsigned int h = mail_hash(name);
+        rv = snprintf(out, size, "%s/%02x/%02x/%s", prefix,
+                      h & (fanout - 1), (h >> 8) & (fanout - 1), name);
+    } else
+        rv = snprintf(out, size, "%s/%s", prefix, name);
+    return rv < 0 || (size_t) rv >= size ? -1 : 0;
+}
+
+/** Builds the path of the directory holding a user's messages.
+ *
+ *  Parameters: layout: Layout of the mail store.
+ *              base: Base directory of the mail store.
+ *              username: Name of the user.
+ *              out, size: Buffer receiving the path.
+ *
+ *  Returns: 0 on success, -1 if the path does not fit in the buffer.
+ */
+int mail_user_dir(const mail_layout *layout, const char *base,
+                  const char *username, char *out, size_t size) {
+    return shard_path(out, size, base, layout->user_fanout, username);
+}
+
+/** Builds the path of a message file inside a user's directory.
+ *
+ *  Parameters: layout: Layout of the mail store.
+ *              userdir: User directory (from mail_user_dir).
+ *              name: File name of the message (e.g., "3.mail").
+ *              out, size: Buffer receiving the path.
+ *
+ *  Returns: 0 on success, -1 if the path does not fit in the buffer.
+ */
+int mail_message_path(const mail_layout *layout, const char *userdir,
+                      const char *name, char *out, size_t size) {
+    return shard_path(out, size, userdir, layout->message_fanout, name);
+}
+
+/** Creates all missing parent directories of a path (but not the
+ *  last component itself). Existing directories are not an error.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int mail_make_parents(const char *path) {
+    char dir[PATH_MAX];
+    size_t len = strlen(path);
+    if (len >= sizeof(dir)) return -1;
+    memcpy(dir, path, len + 1);
+
+    for (char *p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = 0;
+        if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    return 0;
+}
+
+/** Returns non-zero (true) if name looks like a hash directory (two
+ *  lower-case hexadecimal digits).
+ */
+int mail_is_shard_name(const char *name) {
+    return isxdigit((unsigned char) name[0]) && !isupper((unsigned char) name[0]) &&
+        isxdigit((unsigned char) name[1]) && !isupper((unsigned char) name[1]) &&
+        name[2] == 0;
+}
@@ -0,0 +1,42 @@
+/* mailstore.h
+ * Describes the on-disk layout of the mail store: where user
+ * directories and message files live, either flat or hash-sharded.
+ */
+
+#ifndef _MAILSTORE_H_
+#define _MAILSTORE_H_
+
+#include <stddef.h>
+
+#define MAIL_BASE_DIRECTORY "mail.store"
+#define MAIL_FILE_SUFFIX ".mail"
+#define MAIL_LAYOUT_FILE ".layout"
+
+#define MAIL_MAX_FANOUT 256
+
+/* A fanout of 0 means the corresponding level is flat. Otherwise it
+ * is the number of directories (a power of two, at most
+ * MAIL_MAX_FANOUT) on each of the two hash levels.
+ */
+typedef struct mail_layout {
+    unsigned int user_fanout;
+    unsigned int message_fanout;
+} mail_layout;
+
+unsigned int       mail_hash(const char *name);
+
+int                mail_layout_read(const char *base, mail_layout *layout);
+int                mail_layout_write(const char *base, const mail_layout *layout);
+int                mail_layout_valid(const mail_layout *layout);
+const mail_layout *mail_store_layout(void);
+void               mail_store_set_base(const char *base);
+const char        *mail_store_base(void);
+
+int                mail_user_dir(const mail_layout *layout, const char *base,
+                                 const char *username, char *out, size_t size);
+int                mail_message_path(const mail_layout *layout, const char *userdir,
+                                     const char *name, char *out, size_t size);
+int                mail_make_parents(const char *path);
+int                mail_is_shard_name(const char *name);
+
+#endif
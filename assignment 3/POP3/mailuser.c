@@ -8,6 +8,8 @@
  */
 
 #include "mailuser.h"
+#include "mailstore.h"
+#include "userdb.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,10 +21,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
-
-#define USER_FILE_NAME "users.txt"
-#define MAIL_BASE_DIRECTORY "mail.store"
-#define MAIL_FILE_SUFFIX ".mail"
+#include <stdint.h>
 
 struct user_list {
     char *user;
@@ -30,30 +29,23 @@ struct user_list {
 };
 
 struct mail_item {
-    char file_name[2 * NAME_MAX];
+    const char *file_name;      // Points into the list's name storage
     size_t file_size;
+    ino_t inode;
     int deleted;
 };
 
+// The messages of a maildrop are kept in one array, in order, and
+// their paths in one block of storage, so that finding a message by
+// position takes constant time and a large maildrop costs a few dozen
+// bytes per message.
 struct mail_list {
-    struct mail_item item;
-    struct mail_list *next;
+    size_t count;
+    struct mail_item *items;
+    char *names;
+    size_t names_size;
 };
 
-/** Internal function that opens the users file list. If file has been
- *  opened before, rewinds the pointer to beginning of the file.
- * 
- *  Returns: file pointer for users file, or NULL if file cannot be opened.
- */
-static FILE *user_file_list(void) {
-
-    static FILE *file_ptr = NULL;
-    if (!file_ptr)
-        file_ptr = fopen(USER_FILE_NAME, "r+");
-    if (file_ptr)
-        rewind(file_ptr);
-    return file_ptr;
-}
 /** Checks if the user name is valid. If password is supplied, also
  *  checks if the password matches the user name. The username check
  *  ignores case (i.e., upper-case and lower-case letters are
@@ -73,15 +65,7 @@ static FILE *user_file_list(void) {
  *           password, and zero (false) otherwise.
  */
 int is_valid_user(const char *username, const char *password) {
-    FILE *file_ptr = user_file_list();
-    if (!file_ptr) return 0;
-    char user_file[MAX_USERNAME_SIZE+1];
-    char pw_file[MAX_PASSWORD_SIZE+1];
-    while (fscanf(file_ptr, "%s%s", user_file, pw_file) == 2) {
-        if (!strcasecmp(username, user_file))
-            return password == NULL || !strcmp(password, pw_file);
-    }
-    return 0;
+    return userdb_check(username, password);
 }
 
 /** Creates a new, empty, list of users.
@@ -151,24 +135,123 @@ void user_list_destroy(user_list_t list) {
  */
 void save_user_mail(const char *basefile, user_list_t users) {
   
-    char mail_file[2 * NAME_MAX + 1];
+    const mail_layout *layout = mail_store_layout();
+    char user_dir[PATH_MAX];
+    char mail_file[PATH_MAX];
+    char name[NAME_MAX + 1];
   
     // Create base directory if it doesn't exist yet (error ignored)
-    mkdir(MAIL_BASE_DIRECTORY, 0777);
+    mkdir(mail_store_base(), 0777);
   
     for (; users; users = users->next) {
     
-        // Create a directory for the user if it doesn't exist yet. If it
-        // exists mkdir will return an error, which is ignored.
+        // Create a directory for the user (and its hash directories)
+        // if it doesn't exist yet. If it exists mkdir will return an
+        // error, which is ignored.
         int i = 0;
-        sprintf(mail_file, "%s/%s", MAIL_BASE_DIRECTORY, users->user);
-        mkdir(mail_file, 0777);
+        if (mail_user_dir(layout, mail_store_base(), users->user, user_dir, sizeof(user_dir)) < 0)
+            continue;
+        mail_make_parents(user_dir);
+        mkdir(user_dir, 0777);
     
-        // Tries to create a file called 0.mail, if it exists tries 1.mail, and so on
-        do {
-            sprintf(mail_file, "%s/%s/%d" MAIL_FILE_SUFFIX, MAIL_BASE_DIRECTORY, users->user, i++);
-        } while (link(basefile, mail_file) < 0 && errno == EEXIST);
+        // Tries to create a file called 0.mail, if it exists tries
+        // 1.mail, and so on. In a hashed layout the hash directories
+        // for a name are only created when the link reports they are
+        // missing.
+        while (1) {
+            sprintf(name, "%d" MAIL_FILE_SUFFIX, i++);
+            if (mail_message_path(layout, user_dir, name, mail_file, sizeof(mail_file)) < 0)
+                break;
+            if (link(basefile, mail_file) == 0)
+                break;
+            if (errno == ENOENT && layout->message_fanout &&
+                mail_make_parents(mail_file) == 0 && link(basefile, mail_file) == 0)
+                break;
+            if (errno != EEXIST)
+                break;
+        }
+    }
+}
+
+/* Growable arrays of messages (and their paths) found while scanning
+ * a user directory. Until the scan ends, file_name holds an offset in
+ * names, which may still move. */
+struct mail_scan {
+    struct mail_item *items;
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t names_used;
+    size_t names_size;
+    mail_dir_visitor visit;
+    void *visit_arg;
+};
+
+/* Adds the message files in path to scan. If depth is positive, path
+ * holds hash directories, and the files are that many levels below.
+ */
+static void scan_mail_dir(const char *path, int depth, struct mail_scan *scan) {
+
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    struct stat file_stat;
+    if (scan->visit && fstat(dirfd(dir), &file_stat) == 0)
+        scan->visit(path, &file_stat, scan->visit_arg);
+    struct dirent *dir_entry;
+    const size_t suflen = strlen(MAIL_FILE_SUFFIX);
+    const size_t pathlen = strlen(path);
+
+    while ((dir_entry = readdir(dir)) != NULL) {
+
+        if (depth > 0) {
+            if (dir_entry->d_type == DT_DIR && mail_is_shard_name(dir_entry->d_name)) {
+                char subdir[PATH_MAX];
+                snprintf(subdir, sizeof(subdir), "%s/%s", path, dir_entry->d_name);
+                scan_mail_dir(subdir, depth - 1, scan);
+            }
+            continue;
+        }
+
+        size_t namelen = strlen(dir_entry->d_name);
+        if (// Check if it's a regular file (not a directory)
+            dir_entry->d_type == DT_REG &&
+            // Check if the filename is big enough to contain the suffix
+            namelen > suflen &&
+            // Check if the filename ends with the mail suffix
+            !strcmp(dir_entry->d_name + namelen - suflen, MAIL_FILE_SUFFIX)) {
+
+            // Stat relative to the open directory, so the kernel does
+            // not resolve the whole path again for every message.
+            if (pathlen + namelen + 2 > PATH_MAX ||
+                fstatat(dirfd(dir), dir_entry->d_name, &file_stat, 0) < 0)
+                continue;
+
+            if (scan->count == scan->capacity) {
+                scan->capacity = scan->capacity ? 2 * scan->capacity : 64;
+                scan->items = realloc(scan->items, scan->capacity * sizeof(*scan->items));
+            }
+            while (scan->names_used + pathlen + namelen + 2 > scan->names_size) {
+                scan->names_size = scan->names_size ? 2 * scan->names_size : 4096;
+                scan->names = realloc(scan->names, scan->names_size);
+            }
+            struct mail_item *item = &scan->items[scan->count++];
+            item->file_name = (const char *) (uintptr_t) scan->names_used;
+            item->file_size = file_stat.st_size;
+            item->inode = file_stat.st_ino;
+            item->deleted = 0;
+            scan->names_used += sprintf(scan->names + scan->names_used, "%s/%s",
+                                        path, dir_entry->d_name) + 1;
+        }
     }
+    closedir(dir);
+}
+
+/* Orders messages by file name, ignoring the directories they are in. */
+static int compare_mail_names(const void *a, const void *b) {
+    const char *name_a = strrchr(((const struct mail_item *) a)->file_name, '/');
+    const char *name_b = strrchr(((const struct mail_item *) b)->file_name, '/');
+    return strcmp(name_a, name_b);
 }
 
 /** Reads the list of available email messages for a username, based
@@ -184,49 +267,45 @@ void save_user_mail(const char *basefile, user_list_t users) {
  *           available for the provided username.
  */
 mail_list_t load_user_mail(const char *username) {
+    return load_user_mail_visit(username, NULL, NULL);
+}
+
+/** Like load_user_mail, but also reports each directory read, as
+ *  opened, so that a caller keeping the list can later tell whether
+ *  it is still current (a directory changes whenever a file is added
+ *  to it or removed from it).
+ *
+ *  Parameters: username: Name of the user whose email messages should
+ *                        be retrieved.
+ *              visit: Called with the path and status of every
+ *                     directory read, or NULL.
+ *              arg: Passed to visit.
+ */
+mail_list_t load_user_mail_visit(const char *username, mail_dir_visitor visit, void *arg) {
   
-    char filename[2 * NAME_MAX + 1];
-    sprintf(filename, "%s/%s", MAIL_BASE_DIRECTORY, username);
-  
-    DIR *dir = opendir(filename);
-    if (!dir) return NULL;
-  
-    struct stat file_stat;
-    struct dirent *dir_entry;
-    const size_t suflen = strlen(MAIL_FILE_SUFFIX);
-    struct mail_list *list = NULL;
+    const mail_layout *layout = mail_store_layout();
+    char user_dir[PATH_MAX];
+    if (mail_user_dir(layout, mail_store_base(), username, user_dir, sizeof(user_dir)) < 0)
+        return NULL;
   
-    while ((dir_entry = readdir(dir)) != NULL) {
-    
-        if (// Check if it's a regular file (not a directory)
-            dir_entry->d_type == DT_REG &&
-            // Check if the filename is big enough to contain the suffix
-            strlen(dir_entry->d_name) > suflen &&
-            // Check if the filename ends with the mail suffix
-            !strcmp(dir_entry->d_name + strlen(dir_entry->d_name) - suflen, MAIL_FILE_SUFFIX)) {
-      
-            struct mail_list *node = malloc(sizeof(struct mail_list));
-            sprintf(node->item.file_name, "%s/%s/%s",
-                    MAIL_BASE_DIRECTORY, username, dir_entry->d_name);
-      
-            if (stat(node->item.file_name, &file_stat) < 0) {
-                free(node);
-                continue;
-            }
-      
-            node->item.file_size = file_stat.st_size;
-            node->item.deleted = 0;
-            struct mail_list *next = list;
-            struct mail_list **prev = &list;
-            while (next && strcmp(node->item.file_name, next->item.file_name) > 0) {
-                prev = &next->next;
-                next = next->next;
-            }
-            node->next = next;
-            *prev = node;
-        }
+    struct mail_scan scan = { NULL, 0, 0, NULL, 0, 0, visit, arg };
+    scan_mail_dir(user_dir, layout->message_fanout ? 2 : 0, &scan);
+    if (!scan.count) {
+        free(scan.items);
+        free(scan.names);
+        return NULL;
     }
-    closedir(dir);
+
+    struct mail_list *list = malloc(sizeof(struct mail_list));
+    list->count = scan.count;
+    list->items = realloc(scan.items, scan.count * sizeof(*scan.items));
+    list->names = scan.names;
+    list->names_size = scan.names_size;
+    for (size_t i = 0; i < list->count; i++)
+        list->items[i].file_name = list->names + (uintptr_t) list->items[i].file_name;
+    // Sort once, instead of inserting each message in order as it is
+    // found.
+    qsort(list->items, list->count, sizeof(*list->items), compare_mail_names);
     return list;
 }
 
@@ -238,16 +317,18 @@ mail_list_t load_user_mail(const char *username) {
  */
 int mail_list_destroy(mail_list_t list) {
     int errors = 0;
-    while (list) {
-        if (list->item.deleted) {
-            if (unlink(list->item.file_name) < 0) {
+    if (!list)
+        return 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->items[i].deleted) {
+            if (unlink(list->items[i].file_name) < 0) {
                 errors++;
             }
         }
-        mail_list_t next = list->next;
-        free(list);
-        list = next;
     }
+    free(list->items);
+    free(list->names);
+    free(list);
     return errors;
 }
 
@@ -264,11 +345,13 @@ int mail_list_destroy(mail_list_t list) {
  *  Returns: Number of non-deleted messages in list.
  */
 int mail_list_length(mail_list_t list, int includedeleted) {
+    if (!list)
+        return 0;
+    if (includedeleted)
+        return list->count;
     int rv = 0;
-    while (list) {
-        if (includedeleted || !list->item.deleted) rv++;
-        list = list->next;
-    }
+    for (size_t i = 0; i < list->count; i++)
+        if (!list->items[i].deleted) rv++;
     return rv;
 }
 
@@ -290,13 +373,17 @@ int mail_list_length(mail_list_t list, int includedeleted) {
  */
 mail_item_t mail_list_retrieve(mail_list_t list, unsigned int pos) {
   
-    while (list) {
-        if (!pos--)
-            return list->item.deleted ? NULL : &list->item;
-        list = list->next;
-    }
-  
-    return NULL;
+    if (!list || pos >= list->count)
+        return NULL;
+    return list->items[pos].deleted ? NULL : &list->items[pos];
+}
+
+/** Returns the memory used by a list of emails, in bytes.
+ */
+size_t mail_list_footprint(mail_list_t list) {
+    if (!list)
+        return 0;
+    return sizeof(*list) + list->count * sizeof(*list->items) + list->names_size;
 }
 
 /** Returns the total amount of bytes in all email messages in a list
@@ -308,10 +395,8 @@ mail_item_t mail_list_retrieve(mail_list_t list, unsigned int pos) {
  */
 size_t mail_list_size(mail_list_t list) {
     size_t rv = 0;
-    while (list) {
-        rv += list->item.deleted ? 0 : list->item.file_size;
-        list = list->next;
-    }
+    for (size_t i = 0; list && i < list->count; i++)
+        rv += list->items[i].deleted ? 0 : list->items[i].file_size;
     return rv;
 }
 
@@ -338,6 +423,33 @@ FILE *mail_item_contents(mail_item_t item) {
     return fopen(item->file_name, "r");
 }
 
+/** Returns the path of the file holding an email message, for callers
+ *  that read it without stdio.
+ *
+ *  Parameters: item: Email message to be retrieved.
+ */
+const char *mail_item_path(mail_item_t item) {
+    return item->file_name;
+}
+
+/** Writes the unique id of a message (for UIDL): its inode number and
+ *  file name, which together stay the same across sessions and are not
+ *  reused when a name is given to a later message.
+ *
+ *  Parameters: item: Email message.
+ *              out: Buffer receiving the id, of at least
+ *                   MAIL_UID_SIZE bytes.
+ */
+void mail_item_uid(mail_item_t item, char *out) {
+    const char *name = strrchr(item->file_name, '/');
+    name = name ? name + 1 : item->file_name;
+    size_t len = strlen(name) - strlen(MAIL_FILE_SUFFIX);
+    // An id has at most 70 characters.
+    if (len > 50)
+        len = 50;
+    snprintf(out, MAIL_UID_SIZE, "%llx.%.*s", (unsigned long long) item->inode, (int) len, name);
+}
+
 /** Marks a message for deletion in the internal email list. Does not
  *  actually delete the email contents, as a reset call may still
  *  recover the email message. The message is only deleted when the
@@ -359,10 +471,9 @@ int mail_list_undelete(mail_list_t list) {
   
     int rv = 0;
   
-    while (list) {
-        rv += list->item.deleted;
-        list->item.deleted = 0;
-        list = list->next;
+    for (size_t i = 0; list && i < list->count; i++) {
+        rv += list->items[i].deleted;
+        list->items[i].deleted = 0;
     }
   
     return rv;
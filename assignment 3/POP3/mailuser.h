@@ -11,14 +11,18 @@
 #define _MAILUSER_H_
 
 #include <stdio.h>
+#include <sys/stat.h>
 
 #define MAX_USERNAME_SIZE 255
 #define MAX_PASSWORD_SIZE 255
+#define MAIL_UID_SIZE 71
 
 typedef struct user_list *user_list_t;
 typedef struct mail_item *mail_item_t;
 typedef struct mail_list *mail_list_t;
 
+typedef void (*mail_dir_visitor)(const char *path, const struct stat *st, void *arg);
+
 int 	    is_valid_user(const char *username, const char *password);
 
 user_list_t user_list_create(void);
@@ -29,14 +33,18 @@ int 	    user_list_len(user_list_t list);
 void 	    save_user_mail(const char *basefile, user_list_t users);
 
 mail_list_t load_user_mail(const char *username);
+mail_list_t load_user_mail_visit(const char *username, mail_dir_visitor visit, void *arg);
 int         mail_list_destroy(mail_list_t list);
 int         mail_list_length(mail_list_t list, int includedeleted);
 mail_item_t mail_list_retrieve(mail_list_t list, unsigned int pos);
 size_t      mail_list_size(mail_list_t list);
+size_t      mail_list_footprint(mail_list_t list);
 int         mail_list_undelete(mail_list_t list);
 
 size_t      mail_item_size(mail_item_t item);
 FILE       *mail_item_contents(mail_item_t item);
+const char *mail_item_path(mail_item_t item);
+void        mail_item_uid(mail_item_t item, char *out);
 void        mail_item_delete(mail_item_t item);
 
 #endif
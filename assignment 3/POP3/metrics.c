@@ -0,0 +1,431 @@
+/* metrics.c
+ * Counters and latency histograms for the POP3 server.
+ *
+ * Every thread that records something gets a slot of its own, so
+ * recording is a handful of plain increments with no locks or shared
+ * cache lines. Slots are recycled when their thread exits (their
+ * totals keep counting in the next owner), so the number of slots is
+ * bounded by the largest number of threads alive at once. A report
+ * adds all slots together; it may be off by the few updates that are
+ * in flight while it runs.
+ *
+ * Reports are written to stderr on SIGUSR1, and to any client that
+ * connects to the admin socket (e.g., "nc -U /tmp/mypopd.sock").
+ *
+ * With worker processes, each worker publishes the totals of its
+ * threads into its own part of a shared memory region every
+ * PUBLISH_INTERVAL_MS, under a sequence counter that lets the master
+ * copy them without any lock; the master's reports add all workers
+ * together. The totals of a worker that exits are kept (less its last
+ * unpublished updates).
+ *
+ * A worker killed while publishing leaves its counter odd for good, so
+ * the master never waits for a writer: it gives up after a few
+ * attempts and falls back to its own copy of the last totals it read
+ * from that worker.
+ */
+
+#include "metrics.h"
+#include "histogram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define PUBLISH_INTERVAL_MS 100
+#define READ_ATTEMPTS       100
+
+struct metrics_counts {
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+    uint64_t auth_failures;
+    uint64_t bytes_sent;
+    uint64_t commands[MC_COUNT];
+    histogram latency[MC_COUNT];
+    histogram retr_size;
+};
+
+struct metrics_slot {
+    struct metrics_slot *next;
+    int in_use;
+    struct metrics_counts counts;
+};
+
+// A worker process's part of the shared region.
+struct worker_counts {
+    atomic_uint seq;            // Odd while the worker writes
+    int threads;
+    struct metrics_counts counts;
+};
+
+// The master's copy of what it last read from a worker.
+struct worker_snapshot {
+    int threads;
+    struct metrics_counts counts;
+};
+
+static const char *command_names[MC_COUNT] = {
+    "USER", "PASS", "STAT", "LIST", "RETR", "DELE", "RSET", "NOOP", "QUIT", "OTHER"
+};
+
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_slot *slots;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static __thread struct metrics_slot *my_slot;
+
+static struct worker_counts *workers;  // Shared with the worker processes
+static int nworkers;
+static int my_worker = -1;             // Index of this worker process
+static struct worker_snapshot *snapshots;  // In the master, one per worker
+static struct worker_snapshot *scratch;
+static struct metrics_counts *retired; // Totals of the workers that exited
+static uint64_t worker_exits;
+
+static void slot_release(void *slot) {
+    pthread_mutex_lock(&slots_lock);
+    ((struct metrics_slot *) slot)->in_use = 0;
+    pthread_mutex_unlock(&slots_lock);
+}
+
+static void slot_key_init(void) {
+    pthread_key_create(&slot_key, slot_release);
+}
+
+/* Returns the calling thread's slot, claiming one on first use. */
+static struct metrics_slot *slot(void) {
+    if (my_slot)
+        return my_slot;
+
+    pthread_once(&slot_key_once, slot_key_init);
+    pthread_mutex_lock(&slots_lock);
+    struct metrics_slot *s;
+    for (s = slots; s && s->in_use; s = s->next)
+        ;
+    if (!s) {
+        s = calloc(1, sizeof(*s));
+        s->next = slots;
+        slots = s;
+    }
+    s->in_use = 1;
+    pthread_mutex_unlock(&slots_lock);
+    pthread_setspecific(slot_key, s);
+    my_slot = s;
+    return s;
+}
+
+/** Maps a POP3 command name (any case) to its metrics category.
+ */
+metric_command metrics_command(const char *name) {
+    if (!name)
+        return MC_OTHER;
+    for (int i = 0; i < MC_OTHER; i++)
+        if (!strcasecmp(name, command_names[i]))
+            return i;
+    return MC_OTHER;
+}
+
+/** Returns a monotonic timestamp in microseconds.
+ */
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_connection_opened(void) {
+    slot()->counts.connections_opened++;
+}
+
+void metrics_connection_closed(void) {
+    slot()->counts.connections_closed++;
+}
+
+void metrics_auth_failure(void) {
+    slot()->counts.auth_failures++;
+}
+
+void metrics_bytes_sent(size_t bytes) {
+    slot()->counts.bytes_sent += bytes;
+}
+
+void metrics_retr_size(size_t bytes) {
+    hist_record(&slot()->counts.retr_size, bytes);
+}
+
+/** Counts a command and records its latency.
+ *
+ *  Parameters: cmd: Command category.
+ *              started: Value of metrics_now() when the command was
+ *                       received.
+ */
+void metrics_command_done(metric_command cmd, uint64_t started) {
+    struct metrics_counts *c = &slot()->counts;
+    c->commands[cmd]++;
+    hist_record(&c->latency[cmd], metrics_now() - started);
+}
+
+/* Writes a histogram as count, mean, quantiles and maximum. label is
+ * either empty or a label list such as cmd="RETR". */
+static void report_histogram(FILE *out, const char *name, const char *label, const histogram *h) {
+    static const double quantiles[] = { 50, 90, 99, 99.9 };
+    char braces[48] = "";
+    if (*label)
+        snprintf(braces, sizeof(braces), "{%s}", label);
+    fprintf(out, "%s_count%s %llu\n", name, braces, (unsigned long long) h->count);
+    fprintf(out, "%s_mean%s %llu\n", name, braces,
+            (unsigned long long) (h->count ? h->sum / h->count : 0));
+    for (int i = 0; i < sizeof(quantiles) / sizeof(*quantiles); i++)
+        fprintf(out, "%s{%s%squantile=\"%g\"} %llu\n", name, label, *label ? "," : "",
+                quantiles[i] / 100, (unsigned long long) hist_percentile(h, quantiles[i]));
+    fprintf(out, "%s_max%s %llu\n", name, braces, (unsigned long long) h->max);
+}
+
+static void counts_add(struct metrics_counts *total, const struct metrics_counts *c) {
+    total->connections_opened += c->connections_opened;
+    total->connections_closed += c->connections_closed;
+    total->auth_failures += c->auth_failures;
+    total->bytes_sent += c->bytes_sent;
+    for (int i = 0; i < MC_COUNT; i++) {
+        total->commands[i] += c->commands[i];
+        hist_merge(&total->latency[i], &c->latency[i]);
+    }
+    hist_merge(&total->retr_size, &c->retr_size);
+}
+
+/* Adds up the slots of all threads of this process. Returns the number
+ * of threads. */
+static int collect(struct metrics_counts *total) {
+    int threads = 0;
+    pthread_mutex_lock(&slots_lock);
+    for (struct metrics_slot *s = slots; s; s = s->next) {
+        threads += s->in_use;
+        counts_add(total, &s->counts);
+    }
+    pthread_mutex_unlock(&slots_lock);
+    return threads;
+}
+
+/* Refreshes the master's copy of the totals last published by a worker
+ * process and returns it. If no consistent copy can be read within
+ * READ_ATTEMPTS, the previous one is returned unchanged. Called with
+ * slots_lock held. */
+static struct worker_snapshot *read_worker(int worker) {
+    struct worker_counts *w = &workers[worker];
+    for (int attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+        unsigned int seq = atomic_load_explicit(&w->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(&scratch->counts, &w->counts, sizeof(scratch->counts));
+        scratch->threads = w->threads;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&w->seq, memory_order_relaxed) == seq) {
+            memcpy(&snapshots[worker], scratch, sizeof(*scratch));
+            break;
+        }
+    }
+    return &snapshots[worker];
+}
+
+/** Writes the current totals of all threads (of all worker processes,
+ *  in the master of workers), one "name value" pair per line.
+ */
+void metrics_report(FILE *out) {
+    struct metrics_counts *total = calloc(1, sizeof(*total));
+    int threads = 0;
+
+    if (workers && my_worker < 0) {
+        // The lock keeps a worker that exits from being counted twice.
+        pthread_mutex_lock(&slots_lock);
+        for (int i = 0; i < nworkers; i++) {
+            struct worker_snapshot *w = read_worker(i);
+            threads += w->threads;
+            counts_add(total, &w->counts);
+        }
+        counts_add(total, retired);
+        pthread_mutex_unlock(&slots_lock);
+        fprintf(out, "workers %d\n", nworkers);
+        fprintf(out, "worker_exits_total %llu\n", (unsigned long long) worker_exits);
+    } else
+        threads = collect(total);
+
+    fprintf(out, "threads %d\n", threads);
+    fprintf(out, "connections_total %llu\n", (unsigned long long) total->connections_opened);
+    fprintf(out, "connections_active %lld\n",
+            (long long) (total->connections_opened - total->connections_closed));
+    fprintf(out, "auth_failures_total %llu\n", (unsigned long long) total->auth_failures);
+    fprintf(out, "bytes_sent_total %llu\n", (unsigned long long) total->bytes_sent);
+    for (int i = 0; i < MC_COUNT; i++) {
+        char label[32];
+        if (!total->commands[i])
+            continue;
+        snprintf(label, sizeof(label), "cmd=\"%s\"", command_names[i]);
+        fprintf(out, "commands_total{%s} %llu\n", label, (unsigned long long) total->commands[i]);
+        report_histogram(out, "command_latency_us", label, &total->latency[i]);
+    }
+    report_histogram(out, "retr_size_bytes", "", &total->retr_size);
+    fflush(out);
+    free(total);
+}
+
+static void *signal_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) == 0)
+        metrics_report(stderr);
+    return NULL;
+}
+
+static void *admin_thread(void *arg) {
+    int server_fd = (int) (intptr_t) arg;
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        FILE *out = fdopen(fd, "w");
+        if (!out) {
+            close(fd);
+            continue;
+        }
+        metrics_report(out);
+        fclose(out);
+    }
+    return NULL;
+}
+
+/** Starts reporting metrics on SIGUSR1 and, if admin_socket is not
+ *  NULL, on a Unix domain socket at that path. SIGUSR1 must have been
+ *  blocked before any thread was created, so that it is blocked in all
+ *  of them and handled only by the reporting thread.
+ *
+ *  Returns: 0 on success, -1 if the admin socket cannot be created.
+ */
+int metrics_start(const char *admin_socket) {
+    static sigset_t set;
+    pthread_t thread;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_create(&thread, NULL, signal_thread, &set);
+    pthread_detach(thread);
+
+    if (!admin_socket)
+        return 0;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(admin_socket) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, admin_socket);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    unlink(admin_socket);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        close(fd);
+        return -1;
+    }
+    pthread_create(&thread, NULL, admin_thread, (void *) (intptr_t) fd);
+    pthread_detach(thread);
+    return 0;
+}
+
+/** Sets up the shared memory through which worker processes publish
+ *  their totals to the master. Must be called before the workers are
+ *  forked.
+ *
+ *  Parameters: count: Number of worker processes.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int metrics_share(int count) {
+    workers = mmap(NULL, count * sizeof(*workers), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    retired = calloc(1, sizeof(*retired));
+    snapshots = calloc(count, sizeof(*snapshots));
+    scratch = malloc(sizeof(*scratch));
+    if (workers == MAP_FAILED || !retired || !snapshots || !scratch) {
+        workers = NULL;
+        return -1;
+    }
+    nworkers = count;
+    return 0;
+}
+
+/* Publishes the totals of this worker process, periodically. */
+static void *publish_thread(void *arg) {
+    struct worker_counts *w = &workers[my_worker];
+    struct metrics_counts *total = malloc(sizeof(*total));
+    while (1) {
+        memset(total, 0, sizeof(*total));
+        int threads = collect(total);
+
+        unsigned int seq = atomic_load_explicit(&w->seq, memory_order_relaxed);
+        atomic_store_explicit(&w->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        memcpy(&w->counts, total, sizeof(*total));
+        w->threads = threads;
+        atomic_store_explicit(&w->seq, seq + 2, memory_order_release);
+
+        usleep(PUBLISH_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+/** Starts publishing the totals of a worker process to the master.
+ *  Call in the worker, right after the fork and before it creates any
+ *  thread. SIGUSR1 is blocked, as for metrics_start().
+ *
+ *  Parameters: worker: Index of the worker, below the count given to
+ *                      metrics_share().
+ */
+void metrics_worker_start(int worker) {
+    // Only the forking thread came over from the master, which may
+    // have held the slots lock in another thread; the master's slots
+    // are not this process's to report.
+    pthread_mutex_init(&slots_lock, NULL);
+    slots = NULL;
+    my_slot = NULL;
+    my_worker = worker;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, publish_thread, NULL) == 0)
+        pthread_detach(thread);
+}
+
+/** Keeps the totals of a worker process that exited, and clears its
+ *  part of the shared region for its replacement. Call in the master.
+ */
+void metrics_worker_exited(int worker) {
+    // Reports run on other threads of the master.
+    pthread_mutex_lock(&slots_lock);
+    // A worker that died while publishing left its part half written:
+    // the master's last copy stands in for it.
+    struct worker_snapshot *last = &snapshots[worker];
+    if (!(atomic_load(&workers[worker].seq) & 1))
+        last = read_worker(worker);
+    counts_add(retired, &last->counts);
+    worker_exits++;
+    memset(&workers[worker], 0, sizeof(workers[worker]));
+    memset(last, 0, sizeof(*last));
+    pthread_mutex_unlock(&slots_lock);
+}
@@ -0,0 +1,35 @@
+/* metrics.h
+ * Counters and latency histograms for the POP3 server. Each thread
+ * updates its own copy without locking; the copies are only added
+ * together when a report is requested (across worker processes too).
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum metric_command {
+    MC_USER, MC_PASS, MC_STAT, MC_LIST, MC_RETR, MC_DELE,
+    MC_RSET, MC_NOOP, MC_QUIT, MC_OTHER, MC_COUNT
+} metric_command;
+
+metric_command metrics_command(const char *name);
+uint64_t       metrics_now(void);
+
+void           metrics_connection_opened(void);
+void           metrics_connection_closed(void);
+void           metrics_auth_failure(void);
+void           metrics_bytes_sent(size_t bytes);
+void           metrics_retr_size(size_t bytes);
+void           metrics_command_done(metric_command cmd, uint64_t started);
+
+void           metrics_report(FILE *out);
+int            metrics_start(const char *admin_socket);
+
+int            metrics_share(int workers);
+void           metrics_worker_start(int worker);
+void           metrics_worker_exited(int worker);
+
+#endif
@@ -0,0 +1,213 @@
+/* migrate_store.c
+ * Converts a mail store (mail.store in the current directory, or the
+ * directory given with -d, i.e. the server's mail_store setting) from
+ * its current layout to another one (e.g., from the flat layout to a
+ * hash-sharded one). The server should not be running while the store
+ * is migrated.
+ *
+ * Messages are moved with rename() into a new tree next to the
+ * current one (<store>.new), which then replaces the current tree.
+ * The previous tree is kept as <store>.old.<pid> if anything is left
+ * in it.
+ *
+ * An interrupted migration is resumed by running the tool again with
+ * the same fanouts: the messages still in the current tree are moved
+ * into the existing new tree, or, if the current tree was already
+ * renamed away, the new tree is put in its place.
+ */
+
+#define _GNU_SOURCE
+
+#include "mailstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+static const char *base = MAIL_BASE_DIRECTORY;
+static char new_base[PATH_MAX];
+static mail_layout from, to;
+static unsigned long users_moved, messages_moved, errors;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d store] [-u user_fanout] [-m message_fanout]\n", prog);
+    fprintf(stderr, "A fanout of 0 keeps the level flat; otherwise it must be a power of two up to %d.\n",
+            MAIL_MAX_FANOUT);
+    exit(1);
+}
+
+/* Moves every message below path (depth levels of hash directories
+ * deep) into the new user directory. */
+static void move_messages(const char *path, int depth, const char *new_user_dir) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        errors++;
+        return;
+    }
+
+    const size_t suflen = strlen(MAIL_FILE_SUFFIX);
+    char old_path[PATH_MAX], new_path[PATH_MAX];
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL) {
+        snprintf(old_path, sizeof(old_path), "%s/%s", path, entry->d_name);
+        if (depth > 0) {
+            if (entry->d_type == DT_DIR && mail_is_shard_name(entry->d_name))
+                move_messages(old_path, depth - 1, new_user_dir);
+            continue;
+        }
+
+        size_t namelen = strlen(entry->d_name);
+        if (entry->d_type != DT_REG || namelen <= suflen ||
+            strcmp(entry->d_name + namelen - suflen, MAIL_FILE_SUFFIX))
+            continue;
+
+        if (mail_message_path(&to, new_user_dir, entry->d_name, new_path, sizeof(new_path)) < 0 ||
+            mail_make_parents(new_path) < 0 || rename(old_path, new_path) < 0) {
+            perror(old_path);
+            errors++;
+            continue;
+        }
+        messages_moved++;
+    }
+    closedir(dir);
+}
+
+/* Finds every user directory below path (depth levels of hash
+ * directories deep) and moves its messages into the new tree. */
+static void move_users(const char *path, int depth) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        errors++;
+        return;
+    }
+
+    char old_path[PATH_MAX], new_path[PATH_MAX];
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
+            continue;
+        snprintf(old_path, sizeof(old_path), "%s/%s", path, entry->d_name);
+        if (depth > 0) {
+            if (mail_is_shard_name(entry->d_name))
+                move_users(old_path, depth - 1);
+            continue;
+        }
+
+        if (mail_user_dir(&to, new_base, entry->d_name, new_path, sizeof(new_path)) < 0 ||
+            mail_make_parents(new_path) < 0 || (mkdir(new_path, 0777) < 0 && errno != EEXIST)) {
+            perror(new_path);
+            errors++;
+            continue;
+        }
+        move_messages(old_path, from.message_fanout ? 2 : 0, new_path);
+        users_moved++;
+    }
+    closedir(dir);
+}
+
+static int remove_empty(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    if (flag == FTW_DP)
+        rmdir(path);
+    else if (flag == FTW_F && !strcmp(path + ftw->base, MAIL_LAYOUT_FILE))
+        unlink(path);
+    return 0;
+}
+
+/* Returns whether the layout file in base exists and describes layout. */
+static int layout_matches(const char *base, const mail_layout *layout) {
+    char path[PATH_MAX];
+    mail_layout current;
+
+    snprintf(path, sizeof(path), "%s/%s", base, MAIL_LAYOUT_FILE);
+    if (access(path, F_OK) < 0)
+        return 0;
+    return mail_layout_read(base, &current) == 0 &&
+           current.user_fanout == layout->user_fanout &&
+           current.message_fanout == layout->message_fanout;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    char old_base[PATH_MAX], layout_path[PATH_MAX + 16];
+
+    while ((opt = getopt(argc, argv, "d:u:m:")) != -1) {
+        switch (opt) {
+        case 'd': base = optarg; break;
+        case 'u': to.user_fanout = atoi(optarg); break;
+        case 'm': to.message_fanout = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || !mail_layout_valid(&to))
+        usage(argv[0]);
+
+    // Trailing slashes would put the new tree inside the current one.
+    size_t baselen = strlen(base);
+    while (baselen > 1 && base[baselen - 1] == '/')
+        baselen--;
+    snprintf(new_base, sizeof(new_base), "%.*s.new", (int) baselen, base);
+    snprintf(layout_path, sizeof(layout_path), "%s/%s", new_base, MAIL_LAYOUT_FILE);
+
+    // A run that stopped between the two renames below left only the
+    // complete new tree behind.
+    if (access(base, F_OK) < 0 && errno == ENOENT &&
+        layout_matches(new_base, &to)) {
+        if (rename(new_base, base) < 0) {
+            perror("rename");
+            return 1;
+        }
+        printf("Finished the interrupted migration of %s\n", base);
+        return 0;
+    }
+
+    if (mail_layout_read(base, &from) < 0) {
+        fprintf(stderr, "Invalid layout file in %s\n", base);
+        return 1;
+    }
+    if (from.user_fanout == to.user_fanout && from.message_fanout == to.message_fanout) {
+        printf("%s already uses the requested layout\n", base);
+        return 0;
+    }
+    if (mkdir(new_base, 0777) < 0) {
+        if (errno != EEXIST) {
+            perror(new_base);
+            return 1;
+        }
+        // Left by an interrupted run, which wrote the layout file
+        // before moving anything; a tree without one is taken as is.
+        if (!layout_matches(new_base, &to) && access(layout_path, F_OK) == 0) {
+            fprintf(stderr, "%s exists with a different layout\n", new_base);
+            return 1;
+        }
+        printf("Resuming the migration into %s\n", new_base);
+    }
+    if (mail_layout_write(new_base, &to) < 0) {
+        perror(layout_path);
+        return 1;
+    }
+
+    move_users(base, from.user_fanout ? 2 : 0);
+
+    snprintf(old_base, sizeof(old_base), "%.*s.old.%d", (int) baselen, base, (int) getpid());
+    if (rename(base, old_base) < 0 || rename(new_base, base) < 0) {
+        perror("rename");
+        return 1;
+    }
+    nftw(old_base, remove_empty, 16, FTW_DEPTH | FTW_PHYS);
+    if (access(old_base, F_OK) == 0)
+        printf("Files that were not moved remain in %s\n", old_base);
+
+    printf("Moved %lu messages for %lu users, %lu errors\n", messages_moved, users_moved, errors);
+    return errors ? 1 : 0;
+}
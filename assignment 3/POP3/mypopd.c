@@ -2,14 +2,32 @@
 #include "mailuser.h"
 #include "server.h"
 #include "util.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "coro.h"
+#include "slab.h"
+#include "maillock.h"
+#include "mailstore.h"
+#include "userdb.h"
+#include "config.h"
+#include "mailcache.h"
+#include "capture.h"
 //x3
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/utsname.h>
 #include <ctype.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
 
 #define MAX_LINE_LENGTH 1024
+// No POP3 command takes more than two arguments; longer lines are only
+// counted, so that commands reject them as having invalid arguments.
+#define MAX_WORDS 8
 
 typedef enum state {
     Undefined,
@@ -19,27 +37,251 @@ typedef enum state {
     Update
 } State;
 
+// A session lives in a single slab object: this struct, followed by
+// the storage of its net buffer.
 typedef struct serverstate {
     int fd;
-    net_buffer_t nb;
-    char recvbuf[MAX_LINE_LENGTH + 1];
-    char *words[MAX_LINE_LENGTH];
     int nwords;
     State state;
-    struct utsname my_uname;
+    net_buffer_t nb;
+    char *words[MAX_WORDS];
     // TODO: Add additional fields as necessary
-    char username[MAX_LINE_LENGTH]; 
     mail_list_t mail_list;
+    capture_session *capture;   // NULL unless sessions are captured
+    struct sockaddr_storage peer;
+    char username[MAX_USERNAME_SIZE + 1];
+    char recvbuf[MAX_LINE_LENGTH + 1];
 } serverstate;
 
+// Host name sent in the greeting, looked up once at startup
+static struct utsname my_uname;
+static char greeting[sizeof(my_uname.nodename) + 32];
+static slab_cache *sessions;
+
 static void handle_client(void *new_fd);
 
+static const char *config_path;
+static server_config config;
+// Set in the master of worker processes, which serves no sessions
+static int prefork_master;
+static sigset_t reload_signals;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Invalid arguments. Expected: %s [-C config] [-a admin_socket] [-H handoff_socket] [-w threads] [-R capture_file] [-r rate[:burst]] [-f rate[:burst]] [-l] [-p] [-P workers] [-s stack_kb] [-c threads [-k stack_kb] [-u]] [port]\n", prog);
+    fprintf(stderr, "  -C  configuration file (see mypopd.conf), reloaded on SIGHUP\n");
+    fprintf(stderr, "  -H  take over the listening socket of the server on this socket, if any,\n"
+                    "      and hand it to the next one started with the same option\n");
+    fprintf(stderr, "  -w  load maildrop listings on this many threads at startup\n");
+    fprintf(stderr, "  -R  record all sessions to this file (one file per worker, with the worker's\n"
+                    "      number appended), for popreplay\n");
+    fprintf(stderr, "  -r  connections per second allowed from each client address\n");
+    fprintf(stderr, "  -f  failed logins per second allowed from each client address\n");
+    fprintf(stderr, "  -l  also lock maildrops with flock(), for several servers sharing mail.store\n");
+    fprintf(stderr, "  -p  pin threads to CPUs, run sessions on the CPU their connection arrives on\n"
+                    "      and keep their memory on its NUMA node\n");
+    fprintf(stderr, "  -P  serve sessions in this many worker processes, each with its own listening\n"
+                    "      socket; the master restarts any worker that exits\n");
+    fprintf(stderr, "  -s  session thread stack size in KB (default %d)\n", DEFAULT_THREAD_STACK_SIZE / 1024);
+    fprintf(stderr, "  -c  run sessions as coroutines on this many threads\n");
+    fprintf(stderr, "  -k  coroutine stack size in KB (default %d)\n", CORO_DEFAULT_STACK_SIZE / 1024);
+    fprintf(stderr, "  -u  perform coroutine socket and file I/O through io_uring\n");
+    fprintf(stderr, "The port is required unless the configuration file sets it.\n");
+    exit(1);
+}
+
+/* Applies the settings that a reload changes. */
+static void apply_config(void) {
+    ratelimit_configure(&config.connections, &config.auth_failures);
+    be_verbose = config.verbose;
+    if (userdb_load(config.users_file) < 0)
+        perror(config.users_file);
+}
+
+/* Rereads the configuration file (if any) and the users file. Runs on
+ * a thread of its own, so the accept loop and live sessions never
+ * wait for it; they see the new settings on their next use. */
+static void reload(void) {
+    server_config next = config;
+    if (config_path && config_load(config_path, &next) < 0) {
+        fprintf(stderr, "Configuration not reloaded\n");
+        return;
+    }
+    if (strcmp(next.address, config.address) || strcmp(next.port, config.port) ||
+        strcmp(next.mail_store, config.mail_store) || strcmp(next.admin_socket, config.admin_socket) ||
+        strcmp(next.handoff_socket, config.handoff_socket) || strcmp(next.capture_file, config.capture_file))
+        fprintf(stderr, "Changes to address, port, mail_store, admin_socket, handoff_socket and capture_file need a restart\n");
+
+    int backlog_changed = next.backlog != config.backlog;
+    config.backlog = next.backlog;
+    config.connections = next.connections;
+    config.auth_failures = next.auth_failures;
+    config.verbose = next.verbose;
+    strcpy(config.users_file, next.users_file);
+    if (prefork_master) {
+        // Each worker reloads on its own; the master only keeps the
+        // settings for the workers it starts later.
+        server_signal_workers(SIGHUP);
+        return;
+    }
+
+    apply_config();
+    if (backlog_changed)
+        server_set_backlog(config.backlog);
+    fprintf(stderr, "Configuration reloaded\n");
+}
+
+static void *reload_thread(void *arg) {
+    int sig;
+    while (sigwait(&reload_signals, &sig) == 0)
+        reload();
+    return NULL;
+}
+
+/* Starts the threads of a worker process (worker >= 0), or of the
+ * master once the workers run (worker -1): no thread survives a fork,
+ * so they cannot be started any earlier. */
+static void process_start(int worker) {
+    pthread_t thread;
+    if (worker < 0) {
+        prefork_master = 1;
+        if (metrics_start(*config.admin_socket ? config.admin_socket : NULL) < 0) {
+            perror(config.admin_socket);
+            exit(1);
+        }
+    } else {
+        // A worker restarted later was forked from the master, which
+        // does not apply reloaded settings itself.
+        prefork_master = 0;
+        apply_config();
+        metrics_start(NULL);
+        if (*config.capture_file) {
+            char path[PATH_MAX + 16];
+            snprintf(path, sizeof(path), "%s.%d", config.capture_file, worker);
+            if (capture_start(path) < 0) {
+                perror(path);
+                exit(1);
+            }
+        }
+    }
+    pthread_create(&thread, NULL, reload_thread, NULL);
+    pthread_detach(thread);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Invalid arguments. Expected: %s <port>\n", argv[0]);
+    const char *admin_socket = NULL, *handoff_socket = NULL, *connection_rate = NULL, *auth_failure_rate = NULL;
+    const char *capture_file = NULL;
+    int warm_threads = -1, workers = -1;
+    server_options options = { NULL, 0, "-ERR Too many connections, try again later\r\n", 0, 0, 0, 0, NULL, 0, 0, 0, greeting, 0, process_start };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "C:a:H:w:R:r:f:lpP:s:c:k:u")) != -1) {
+        switch (opt) {
+        case 'C': config_path = optarg; break;
+        case 'a': admin_socket = optarg; break;
+        case 'H': handoff_socket = optarg; break;
+        case 'R': capture_file = optarg; break;
+        case 'w': if ((warm_threads = atoi(optarg)) <= 0) usage(argv[0]); break;
+        case 'r': connection_rate = optarg; break;
+        case 'f': auth_failure_rate = optarg; break;
+        case 'l': maildrop_lock_use_files(1); break;
+        case 'p': options.pin_cpus = 1; break;
+        case 'P': if ((workers = atoi(optarg)) <= 0) usage(argv[0]); break;
+        case 's': if (atoi(optarg) < 16) usage(argv[0]);
+                  options.thread_stack = (size_t) atoi(optarg) * 1024; break;
+        case 'c': if ((options.coroutine_threads = atoi(optarg)) <= 0) usage(argv[0]); break;
+        case 'k': if (atoi(optarg) < 16) usage(argv[0]);
+                  options.coroutine_stack = (size_t) atoi(optarg) * 1024; break;
+        case 'u': options.io_uring = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    // Command-line options override the configuration file.
+    config_defaults(&config);
+    if (config_path && config_load(config_path, &config) < 0)
+        return 1;
+    if ((admin_socket && strlen(admin_socket) >= sizeof(config.admin_socket)) ||
+        (handoff_socket && strlen(handoff_socket) >= sizeof(config.handoff_socket)) ||
+        (capture_file && strlen(capture_file) >= sizeof(config.capture_file)) ||
+        (connection_rate && ratelimit_parse(connection_rate, &config.connections) < 0) ||
+        (auth_failure_rate && ratelimit_parse(auth_failure_rate, &config.auth_failures) < 0) ||
+        (optind < argc && strlen(argv[optind]) >= sizeof(config.port)))
+        usage(argv[0]);
+    if (admin_socket)
+        strcpy(config.admin_socket, admin_socket);
+    if (handoff_socket)
+        strcpy(config.handoff_socket, handoff_socket);
+    if (warm_threads > 0)
+        config.warm_threads = warm_threads;
+    if (capture_file)
+        strcpy(config.capture_file, capture_file);
+    if (workers > 0)
+        config.workers = workers;
+    if (optind < argc)
+        strcpy(config.port, argv[optind++]);
+    if (optind != argc || !*config.port || (options.io_uring && !options.coroutine_threads))
+        usage(argv[0]);
+    if (config.workers > 0 && *config.handoff_socket) {
+        fprintf(stderr, "Worker processes cannot hand over the listening socket\n");
         return 1;
     }
-    run_server(argv[1], handle_client);
+
+    // SIGHUP and SIGUSR1 are blocked in every thread, so they must be
+    // blocked before the first one (of the capture or the warm-up)
+    // starts; the reload and metrics threads take them.
+    sigset_t blocked;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    blocked = reload_signals;
+    sigaddset(&blocked, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+
+    mail_store_set_base(config.mail_store);
+    apply_config();
+    // Workers each capture to a file of their own.
+    if (!config.workers && *config.capture_file && capture_start(config.capture_file) < 0) {
+        perror(config.capture_file);
+        return 1;
+    }
+    // Runs in the background while the server starts accepting, except
+    // with workers: they are forked once the cache is complete, and
+    // share it.
+    if (config.warm_threads > 0 &&
+        mailcache_warm(config.warm_threads, config.warm_budget, config.warm_recent,
+                       config.workers > 0) < 0)
+        perror("warm-up");
+    options.address = *config.address ? config.address : NULL;
+    options.backlog = config.backlog;
+    options.pin_cpus |= config.pin_cpus;
+    options.fastopen = config.fastopen;
+    options.accept_batch = config.accept_batch;
+    options.workers = config.workers;
+    if (*config.handoff_socket) {
+        options.handoff_socket = config.handoff_socket;
+        // The old and the new server serve sessions side by side until
+        // the old one has drained, so maildrops are locked across both.
+        maildrop_lock_use_files(1);
+    }
+    // Worker processes serve sessions side by side all the time.
+    if (config.workers > 0)
+        maildrop_lock_use_files(1);
+    uname(&my_uname);
+    // The server sends the greeting as it accepts the connection.
+    snprintf(greeting, sizeof(greeting), "+OK POP3 Server on %s ready\r\n", my_uname.nodename);
+    sessions = slab_create(sizeof(serverstate) + nb_footprint(MAX_LINE_LENGTH), 64);
+
+    // The master of workers starts these once it has forked them.
+    if (!config.workers) {
+        pthread_t thread;
+        if (metrics_start(*config.admin_socket ? config.admin_socket : NULL) < 0) {
+            perror(config.admin_socket);
+            return 1;
+        }
+        pthread_create(&thread, NULL, reload_thread, NULL);
+        pthread_detach(thread);
+    }
+
+    run_server(config.port, handle_client, &options);
     return 0;
 }
 
@@ -86,7 +328,7 @@ int do_user(serverstate *ss) {
 
     char *input_email = ss->words[1];
     if (is_valid_user(input_email, NULL)){
-        strncpy(ss->username, input_email, sizeof(ss->username));
+        snprintf(ss->username, sizeof(ss->username), "%s", input_email);
         send_formatted(ss->fd, "+OK User is valid, proceed with password\r\n");
         return 0;
     };
@@ -102,12 +344,23 @@ int do_pass(serverstate *ss) {
         return 1; 
     }
     char *input_password = ss->words[1];
+    if (!ratelimit_auth_allowed((struct sockaddr *)&ss->peer)) {
+        send_formatted(ss->fd, "-ERR Too many failed logins, try again later\r\n");
+        return -1;
+    }
     if (is_valid_user(ss->username, input_password)) {
+        if (maildrop_lock(ss->username) < 0) {
+            send_formatted(ss->fd, "-ERR Unable to lock maildrop, already in use\r\n");
+            return 1;
+        }
         send_formatted(ss->fd, "+OK Password is valid, mail loaded\r\n");
-        ss->mail_list = load_user_mail(ss->username);
+        if (!mailcache_take(ss->username, &ss->mail_list))
+            ss->mail_list = load_user_mail(ss->username);
         ss->state = Transaction;
         return 0;
     }
+    metrics_auth_failure();
+    ratelimit_auth_failure((struct sockaddr *)&ss->peer);
     send_formatted(ss->fd, "-ERR Invalid password\r\n");
     return 1;
 }
@@ -124,25 +377,59 @@ int do_stat(serverstate *ss) {
     return 0;
 }
 
+/* Sends the multi-line response of LIST or UIDL, one line per message
+ * not marked as deleted. Lines are formatted into a single
+ * CORO_BUFFER_SIZE buffer, which is sent whenever it fills up: the
+ * memory used stays the same however large the maildrop, and the next
+ * chunk is only formatted once the client has taken the previous one
+ * (send_all waits for room in the socket buffer).
+ *
+ * Returns: 0 on success, 1 if no buffer was available (an error was
+ * sent), -1 if sending failed part way and the session must end. */
+static int send_listing(serverstate *ss, int uids) {
+    char *out = coro_buffer_get();
+    char uid[MAIL_UID_SIZE];
+    if (!out) {
+        send_formatted(ss->fd, "-ERR Out of memory\r\n");
+        return 1;
+    }
+    int total = mail_list_length(ss->mail_list, 1);
+    size_t len = snprintf(out, CORO_BUFFER_SIZE, "+OK %d messages\r\n",
+                          mail_list_length(ss->mail_list, 0));
+    for (int i = 0; i < total; i++) {
+        mail_item_t item = mail_list_retrieve(ss->mail_list, i);
+        if (!item)
+            continue;
+        // A line is at most MAIL_UID_SIZE plus a number and CRLF.
+        if (CORO_BUFFER_SIZE - len < MAIL_UID_SIZE + 32) {
+            if (send_all(ss->fd, out, len) <= 0) {
+                // The terminator would make the partial listing look
+                // complete, so the session ends instead.
+                coro_buffer_put(out);
+                return -1;
+            }
+            len = 0;
+        }
+        if (uids) {
+            mail_item_uid(item, uid);
+            len += snprintf(out + len, CORO_BUFFER_SIZE - len, "%d %s\r\n", i + 1, uid);
+        } else {
+            len += snprintf(out + len, CORO_BUFFER_SIZE - len, "%d %zu\r\n", i + 1,
+                            mail_item_size(item));
+        }
+    }
+    memcpy(out + len, ".\r\n", 3);
+    int failed = send_all(ss->fd, out, len + 3) <= 0;
+    coro_buffer_put(out);
+    return failed ? -1 : 0;
+}
+
 int do_list(serverstate *ss) {
     dlog("Executing list\n");
     // TODO: Implement this function
     int num_mails = mail_list_length(ss->mail_list, 0);
-    int num_total_mails = mail_list_length(ss->mail_list, 1);
-    if (!ss->mail_list) {
-        send_formatted(ss->fd, "+OK 0 messages\r\n.\r\n");
-        return 0;
-    }
     if (ss->nwords == 1) {
-        send_formatted(ss->fd, "+OK %d messages\r\n", num_mails);
-        for (int i = 0; i < num_total_mails; i++) {
-            mail_item_t item = mail_list_retrieve(ss->mail_list, i);
-            if (item) {
-                send_formatted(ss->fd, "%d %zu\r\n", i + 1, mail_item_size(item));
-            }
-        }
-        send_formatted(ss->fd, ".\r\n");
-        return 0;
+        return send_listing(ss, 0);
     } else if (ss->nwords == 2) {
         int msg_num = atoi(ss->words[1]);
         if (msg_num <= 0) {
@@ -164,6 +451,27 @@ int do_list(serverstate *ss) {
     
 }
 
+int do_uidl(serverstate *ss) {
+    dlog("Executing uidl\n");
+    if (ss->nwords == 1) {
+        return send_listing(ss, 1);
+    } else if (ss->nwords == 2) {
+        int msg_num = atoi(ss->words[1]);
+        mail_item_t item = msg_num > 0 ? mail_list_retrieve(ss->mail_list, msg_num - 1) : NULL;
+        if (item == NULL) {
+            send_formatted(ss->fd, "-ERR no such message\r\n");
+            return 1;
+        }
+        char uid[MAIL_UID_SIZE];
+        mail_item_uid(item, uid);
+        send_formatted(ss->fd, "+OK %d %s\r\n", msg_num, uid);
+        return 0;
+    } else {
+        send_formatted(ss->fd, "-ERR Invalid arguments\r\n");
+        return 1;
+    }
+}
+
 int do_retr(serverstate *ss) {
     dlog("Executing retr\n");
     // TODO: Implement this function
@@ -183,22 +491,68 @@ int do_retr(serverstate *ss) {
         return 1;
     }
 
-    FILE *file = mail_item_contents(item);
-    send_formatted(ss->fd, "+OK message follows\r\n");
-    char line[MAX_LINE_LENGTH];
-    while (fgets(line, sizeof(line), file)) {
-        if (line[0] == '.') {
-            send_formatted(ss->fd, ".%s", line);
-        } else {
-            send_formatted(ss->fd, "%s", line);
-        }
+    metrics_retr_size(mail_item_size(item));
+    int file = coro_open(mail_item_path(item), O_RDONLY);
+    if (file < 0) {
+        send_formatted(ss->fd, "-ERR Cannot read message\r\n");
+        return 1;
     }
 
-    fclose(file);
+    // The message is read and sent in chunks, byte-stuffing lines that
+    // start with '.', so that a small message goes out in one send
+    // together with the status line and the terminator.
+    char *in = coro_buffer_get(), *out = coro_buffer_get();
+    if (!in || !out) {
+        if (in)
+            coro_buffer_put(in);
+        if (out)
+            coro_buffer_put(out);
+        close(file);
+        send_formatted(ss->fd, "-ERR Out of memory\r\n");
+        return 1;
+    }
+    size_t out_len = sprintf(out, "+OK message follows\r\n");
+    int line_start = 1, failed = 0;
+    off_t offset = 0;
+    ssize_t n;
+    while (!failed && (n = coro_read(file, in, CORO_BUFFER_SIZE, offset)) > 0) {
+        offset += n;
+        for (ssize_t i = 0; i < n; i++) {
+            if (out_len + 2 > CORO_BUFFER_SIZE) {
+                if (send_all(ss->fd, out, out_len) <= 0) {
+                    failed = 1;
+                    break;
+                }
+                out_len = 0;
+            }
+            if (line_start && in[i] == '.')
+                out[out_len++] = '.';
+            out[out_len++] = in[i];
+            line_start = in[i] == '\n';
+        }
+    }
+    close(file);
 
-    send_formatted(ss->fd, ".\r\n");
+    // After a read or send error the client has part of the message
+    // behind +OK; the terminator would make it look complete, so the
+    // session ends instead.
+    if (failed || n < 0) {
+        coro_buffer_put(in);
+        coro_buffer_put(out);
+        return -1;
+    }
+    if (out_len + 3 > CORO_BUFFER_SIZE) {
+        failed = send_all(ss->fd, out, out_len) <= 0;
+        out_len = 0;
+    }
+    if (!failed) {
+        memcpy(out + out_len, ".\r\n", 3);
+        failed = send_all(ss->fd, out, out_len + 3) <= 0;
+    }
+    coro_buffer_put(in);
+    coro_buffer_put(out);
 
-    return 0;
+    return failed ? -1 : 0;
 }
 
 int do_rset(serverstate *ss) {
@@ -243,71 +597,90 @@ int do_dele(serverstate *ss) {
 void handle_client(void *new_fd) {
     int fd = *(int *)(new_fd);
 
-    size_t len;
-    serverstate mstate, *ss = &mstate;
+    int len;
+    serverstate *ss = slab_alloc(sessions);
+    if (!ss)
+        return;
 
     ss->fd = fd;
-    ss->nb = nb_create(fd, MAX_LINE_LENGTH);
+    ss->nb = nb_init(ss + 1, fd, MAX_LINE_LENGTH);
     ss->state = Undefined;
-    uname(&ss->my_uname);
+    ss->mail_list = NULL;
+    socklen_t peer_len = sizeof(ss->peer);
+    if (getpeername(fd, (struct sockaddr *)&ss->peer, &peer_len) < 0)
+        ss->peer.ss_family = AF_UNSPEC;
+    metrics_connection_opened();
     // TODO: Initialize additional fields in `serverstate`, if any
-    if (send_formatted(fd, "+OK POP3 Server on %s ready\r\n", ss->my_uname.nodename) <= 0) return;
+    ss->capture = capture_open(fd);
+    // The greeting has already been sent (see run_server).
     ss->state = Authorization;
-    while ((len = nb_read_line(ss->nb, ss->recvbuf)) >= 0) {
+    // nb_read_line returns 0 when the client closes the connection and
+    // -1 on errors; both end the session.
+    while ((len = nb_read_line(ss->nb, ss->recvbuf)) > 0) {
+        capture_command(ss->capture, ss->recvbuf, len);
         if (ss->recvbuf[len - 1] != '\n') {
         send_formatted(ss->fd, "-ERR Syntax error, command too long\r\n");
         break;
         }
 
-        while (isspace(ss->recvbuf[len - 1])) ss->recvbuf[--len] = 0;
+        uint64_t started = metrics_now();
+        while (len > 0 && isspace(ss->recvbuf[len - 1])) ss->recvbuf[--len] = 0;
         dlog("%x: Command is %s\n", fd, ss->recvbuf);
 
-        ss->nwords = split(ss->recvbuf, ss->words);
-        char *command = ss->words[0];
+        ss->nwords = split(ss->recvbuf, ss->words, MAX_WORDS);
+        // An empty line is an unknown command.
+        char *command = ss->nwords ? ss->words[0] : "";
+        int rv = 0;
 
         /* TODO: Handle the different values of `command` and dispatch it to the correct implementation
-         *  TOP, UIDL, APOP commands do not need to be implemented and therefore may return an error response */
+         *  TOP, APOP commands do not need to be implemented and therefore may return an error response */
         if (ss->state == Authorization) {
             if (strcasecmp(command, "QUIT") == 0) {
-                if (do_quit(ss) == -1) break;
+                rv = do_quit(ss);
             } else if (strcasecmp(command, "USER") == 0) {
-                if (do_user(ss) == -1) break;
+                rv = do_user(ss);
             } else if (strcasecmp(command, "PASS") == 0) {
-                if (do_pass(ss) == -1) break;
+                rv = do_pass(ss);
             } else {
                 send_formatted(fd, "-ERR Bad sequence of commands\r\n");
             }
         } else if (ss->state == Transaction) {
             // Handle other POP3 commands 
             if (strcasecmp(command, "STAT") == 0) {
-                if (do_stat(ss) == -1) break;
+                rv = do_stat(ss);
             } else if (strcasecmp(command, "LIST") == 0) {
-                if (do_list(ss) == -1) break;
+                rv = do_list(ss);
+            } else if (strcasecmp(command, "UIDL") == 0) {
+                rv = do_uidl(ss);
             } else if (strcasecmp(command, "RETR") == 0) {
-                if (do_retr(ss) == -1) break;
+                rv = do_retr(ss);
             } else if (strcasecmp(command, "DELE") == 0) {
-                if (do_dele(ss) == -1) break;
+                rv = do_dele(ss);
             } else if (strcasecmp(command, "RSET") == 0) {
-                if (do_rset(ss) == -1) break;
+                rv = do_rset(ss);
             } else if (strcasecmp(command, "NOOP") == 0) {
-                if (do_noop(ss) == -1) break;
+                rv = do_noop(ss);
             } else if (strcasecmp(command, "QUIT") == 0) {
-                if (do_quit(ss) == -1){
+                if ((rv = do_quit(ss)) == -1){
                     ss->state = Update;
                     int deleted_number = mail_list_destroy(ss->mail_list);
                     dlog(" %d errors deleting messages", deleted_number);
+                    maildrop_unlock(ss->username);
                     ss->state = Undefined;
-                    
-                    break;
                 }
             } else {
                 send_formatted(fd, "-ERR Bad sequence of commands\r\n");
             }
         }
+        metrics_command_done(metrics_command(command), started);
+        if (rv == -1) break;
     }
     // TODO: Clean up fields in `serverstate`, if required
-    nb_destroy(ss->nb);
-    close(fd);
+    if (ss->state == Transaction)
+        maildrop_unlock(ss->username);
+    capture_close(ss->capture);
+    metrics_connection_closed();
+    slab_free(sessions, ss);
+    // The server closes fd once the handler returns.
     //free(new_fd);
 }
-
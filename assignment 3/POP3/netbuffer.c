@@ -6,6 +6,7 @@
  */
 
 #include "netbuffer.h"
+#include "coro.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,7 +41,28 @@ struct net_buffer {
  */
 net_buffer_t nb_create(int fd, size_t max_buffer_size) {
 
-    net_buffer_t nb = malloc(sizeof(struct net_buffer) + max_buffer_size);
+    return nb_init(malloc(nb_footprint(max_buffer_size)), fd, max_buffer_size);
+}
+
+/** Returns the number of bytes a buffer of the given maximum size
+ *  occupies, for callers that embed it in memory of their own.
+ */
+size_t nb_footprint(size_t max_buffer_size) {
+    return sizeof(struct net_buffer) + max_buffer_size;
+}
+
+/** Initializes a buffer in caller-provided memory of at least
+ *  nb_footprint(max_buffer_size) bytes. Such a buffer must not be
+ *  passed to nb_destroy; it goes away with the memory.
+ *
+ *  Parameters: mem: Memory for the buffer.
+ *              fd: Socket file descriptor.
+ *              max_buffer_size: As in nb_create.
+ *
+ *  Returns: A net_buffer_t object located at mem.
+ */
+net_buffer_t nb_init(void *mem, int fd, size_t max_buffer_size) {
+    net_buffer_t nb = mem;
     nb->fd          = fd;
     nb->max_bytes   = max_buffer_size;
     nb->avail_data  = 0;
@@ -92,7 +114,7 @@ int nb_read_line(net_buffer_t nb, char out[]) {
 
         // Check if the buffer has space for more data to be received
         if (nb->avail_data < nb->max_bytes) {
-            rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
+            rv = coro_recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
             // If recv returns an error, return the same error.
             if (rv < 0)
                 return rv;
@@ -131,7 +153,7 @@ int nb_read_bytes(net_buffer_t nb, char out[], size_t num) {
 
         // Check if the buffer has space for more data to be received
         if (nb->avail_data < nb->max_bytes) {
-            rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
+            rv = coro_recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
             // If recv returns an error, return the same error.
             if (rv < 0)
                 return rv;
@@ -13,6 +13,8 @@ typedef struct net_buffer *net_buffer_t;
 
 net_buffer_t nb_create(int fd, size_t max_buffer_size);
 void         nb_destroy(net_buffer_t nb);
+size_t       nb_footprint(size_t max_buffer_size);
+net_buffer_t nb_init(void *mem, int fd, size_t max_buffer_size);
 int          nb_read_line(net_buffer_t nb, char out[]);
 int          nb_read_bytes(net_buffer_t nb, char out[], size_t num);
 #endif
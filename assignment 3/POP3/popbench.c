@@ -0,0 +1,303 @@
+/* popbench.c
+ * Microbenchmarks for the primitives on the server's hot path:
+ * nb_read_line(), split(), send_formatted(), load_user_mail() and
+ * mail_list_retrieve(), each with synthetic inputs of increasing size.
+ *
+ * Every result is printed as one JSON object per line, e.g.
+ *
+ *   {"rev":"c4d6324","bench":"split","param":"words=16","ops":...,"ns_per_op":...}
+ *
+ * so that runs from different commits can be compared with any tool
+ * that reads JSON lines. Run it through "make bench".
+ */
+
+#include "netbuffer.h"
+#include "mailuser.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define MAX_LINE_LENGTH 1024
+#define REPEATS 5
+#define TARGET_NS 100000000ULL /* Aim for 0.1 s per measurement */
+
+static const char *revision = "unknown";
+static long max_maildrop = 1000000;
+
+typedef void (*bench_fn)(void *arg, long ops);
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Runs fn with a number of operations calibrated to take about
+ * TARGET_NS, REPEATS times, and prints the best and median cost. */
+static void run(const char *bench, const char *param, bench_fn fn, void *arg, long max_ops) {
+    long ops = 1;
+    unsigned long long elapsed;
+    double samples[REPEATS];
+
+    while (1) {
+        unsigned long long start = now_ns();
+        fn(arg, ops);
+        elapsed = now_ns() - start;
+        if (elapsed >= TARGET_NS / 10 || ops >= max_ops)
+            break;
+        ops = ops * 10 > max_ops ? max_ops : ops * 10;
+    }
+    if (elapsed && elapsed < TARGET_NS) {
+        long scaled = ops * (double) TARGET_NS / elapsed;
+        ops = scaled > max_ops ? max_ops : scaled < 1 ? 1 : scaled;
+    }
+
+    for (int i = 0; i < REPEATS; i++) {
+        unsigned long long start = now_ns();
+        fn(arg, ops);
+        samples[i] = (double) (now_ns() - start) / ops;
+    }
+    qsort(samples, REPEATS, sizeof(double), compare_double);
+    printf("{\"rev\":\"%s\",\"bench\":\"%s\",\"param\":\"%s\",\"ops\":%ld,"
+           "\"ns_per_op\":%.1f,\"ns_per_op_min\":%.1f}\n",
+           revision, bench, param, ops, samples[REPEATS / 2], samples[0]);
+    fflush(stdout);
+}
+
+/* nb_read_line: lines of a given length, "depth" lines written to the
+ * socket at once (as a pipelining client would), then read back. */
+
+struct read_line_arg {
+    int fds[2];
+    net_buffer_t nb;
+    char *batch;
+    size_t batch_len;
+    int depth;
+};
+
+static void bench_read_line(void *varg, long ops) {
+    struct read_line_arg *arg = varg;
+    char out[MAX_LINE_LENGTH + 1];
+    for (long done = 0; done < ops; ) {
+        send_all(arg->fds[0], arg->batch, arg->batch_len);
+        for (int i = 0; i < arg->depth; i++)
+            nb_read_line(arg->nb, out);
+        done += arg->depth;
+    }
+}
+
+static void run_read_line(void) {
+    static const int lengths[] = { 8, 64, 512, 1000 };
+    static const int depths[] = { 1, 16, 128 };
+    char param[64];
+
+    for (int l = 0; l < sizeof(lengths) / sizeof(*lengths); l++) {
+        for (int d = 0; d < sizeof(depths) / sizeof(*depths); d++) {
+            struct read_line_arg arg;
+            int bufsize = 4 << 20;
+            socketpair(AF_UNIX, SOCK_STREAM, 0, arg.fds);
+            setsockopt(arg.fds[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+            setsockopt(arg.fds[1], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+            arg.nb = nb_create(arg.fds[1], MAX_LINE_LENGTH);
+            arg.depth = depths[d];
+            arg.batch_len = (size_t) lengths[l] * depths[d];
+            arg.batch = malloc(arg.batch_len);
+            for (int i = 0; i < depths[d]; i++) {
+                memset(arg.batch + i * lengths[l], 'x', lengths[l] - 2);
+                memcpy(arg.batch + (i + 1) * lengths[l] - 2, "\r\n", 2);
+            }
+            snprintf(param, sizeof(param), "len=%d,depth=%d", lengths[l], depths[d]);
+            run("nb_read_line", param, bench_read_line, &arg, 10000000);
+            nb_destroy(arg.nb);
+            free(arg.batch);
+            close(arg.fds[0]);
+            close(arg.fds[1]);
+        }
+    }
+}
+
+/* split: a command line with a given number of words. */
+
+struct split_arg {
+    char line[MAX_LINE_LENGTH + 1];
+    size_t len;
+};
+
+static void bench_split(void *varg, long ops) {
+    struct split_arg *arg = varg;
+    char buf[MAX_LINE_LENGTH + 1];
+    char *words[MAX_LINE_LENGTH];
+    for (long i = 0; i < ops; i++) {
+        memcpy(buf, arg->line, arg->len + 1);
+        split(buf, words, MAX_LINE_LENGTH);
+    }
+}
+
+static void run_split(void) {
+    static const int counts[] = { 1, 2, 4, 16, 128 };
+    char param[64];
+
+    for (int c = 0; c < sizeof(counts) / sizeof(*counts); c++) {
+        struct split_arg arg;
+        arg.len = 0;
+        for (int i = 0; i < counts[c]; i++)
+            arg.len += sprintf(arg.line + arg.len, "%sword%d", i ? " " : "", i);
+        snprintf(param, sizeof(param), "words=%d", counts[c]);
+        run("split", param, bench_split, &arg, 100000000);
+    }
+}
+
+/* send_formatted: short and long responses to a socket drained by a
+ * separate thread. */
+
+struct send_arg {
+    int fds[2];
+    const char *fmt;
+    const char *text;
+};
+
+static void *drain(void *varg) {
+    int fd = *(int *) varg;
+    char buf[65536];
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+        ;
+    return NULL;
+}
+
+static void bench_send_formatted(void *varg, long ops) {
+    struct send_arg *arg = varg;
+    for (long i = 0; i < ops; i++)
+        send_formatted(arg->fds[0], arg->fmt, (int) i, arg->text);
+}
+
+static void run_send_formatted(void) {
+    static const int sizes[] = { 0, 64, 1000, 8000 };
+    char param[64];
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+        struct send_arg arg;
+        pthread_t thread;
+        char *text = malloc(sizes[s] + 1);
+        memset(text, 'x', sizes[s]);
+        text[sizes[s]] = 0;
+        socketpair(AF_UNIX, SOCK_STREAM, 0, arg.fds);
+        pthread_create(&thread, NULL, drain, &arg.fds[1]);
+        arg.fmt = "+OK %d %s\r\n";
+        arg.text = text;
+        snprintf(param, sizeof(param), "bytes=%d", sizes[s]);
+        run("send_formatted", param, bench_send_formatted, &arg, 10000000);
+        shutdown(arg.fds[0], SHUT_WR);
+        pthread_join(thread, NULL);
+        close(arg.fds[0]);
+        close(arg.fds[1]);
+        free(text);
+    }
+}
+
+/* load_user_mail and mail_list_retrieve: maildrops of 10 messages up
+ * to max_maildrop, in a temporary flat mail store. */
+
+#define BENCH_USER "bench@example.com"
+
+struct maildrop_arg {
+    long size;
+    mail_list_t list;
+    unsigned int seed;
+};
+
+static void bench_load(void *varg, long ops) {
+    for (long i = 0; i < ops; i++)
+        mail_list_destroy(load_user_mail(BENCH_USER));
+}
+
+static void bench_retrieve(void *varg, long ops) {
+    struct maildrop_arg *arg = varg;
+    for (long i = 0; i < ops; i++)
+        mail_list_retrieve(arg->list, rand_r(&arg->seed) % arg->size);
+}
+
+static void run_maildrop(void) {
+    char dir[] = "/tmp/popbench.XXXXXX";
+    char path[256], param[64];
+    char cwd[4096];
+
+    if (!getcwd(cwd, sizeof(cwd)) || !mkdtemp(dir) || chdir(dir) < 0) {
+        perror("maildrop setup");
+        return;
+    }
+    mkdir("mail.store", 0777);
+    mkdir("mail.store/" BENCH_USER, 0777);
+    FILE *file = fopen("template", "w");
+    fprintf(file, "From: bench\nSubject: benchmark\n\nHello\n");
+    fclose(file);
+
+    long created = 0;
+    for (long size = 10; size <= max_maildrop; size *= 10) {
+        for (; created < size; created++) {
+            snprintf(path, sizeof(path), "mail.store/" BENCH_USER "/%ld.mail", created);
+            if (link("template", path) < 0) {
+                perror(path);
+                goto cleanup;
+            }
+        }
+        struct maildrop_arg arg = { size, NULL, 1 };
+        snprintf(param, sizeof(param), "messages=%ld", size);
+        run("load_user_mail", param, bench_load, &arg, 1000000);
+
+        arg.list = load_user_mail(BENCH_USER);
+        run("mail_list_retrieve", param, bench_retrieve, &arg, 100000000);
+        mail_list_destroy(arg.list);
+    }
+
+ cleanup:
+    while (created-- > 0) {
+        snprintf(path, sizeof(path), "mail.store/" BENCH_USER "/%ld.mail", created);
+        unlink(path);
+    }
+    rmdir("mail.store/" BENCH_USER);
+    rmdir("mail.store");
+    unlink("template");
+    if (chdir(cwd) == 0)
+        rmdir(dir);
+}
+
+int main(int argc, char *argv[]) {
+    const char *only = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:m:b:")) != -1) {
+        switch (opt) {
+        case 'r': revision = optarg; break;
+        case 'm': max_maildrop = atol(optarg); break;
+        case 'b': only = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-r revision] [-m max_maildrop] [-b benchmark]\n", argv[0]);
+            return 1;
+        }
+    }
+    be_verbose = 0;
+
+    if (!only || !strcmp(only, "nb_read_line"))
+        run_read_line();
+    if (!only || !strcmp(only, "split"))
+        run_split();
+    if (!only || !strcmp(only, "send_formatted"))
+        run_send_formatted();
+    if (!only || !strcmp(only, "load_user_mail") || !strcmp(only, "mail_list_retrieve"))
+        run_maildrop();
+    return 0;
+}
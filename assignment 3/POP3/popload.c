@@ -0,0 +1,504 @@
+/* popload.c
+ * Load generator for mypopd. Opens many concurrent POP3 sessions
+ * against a server (one epoll loop, non-blocking sockets), replays a
+ * configurable mix of commands in each session, and reports
+ * throughput and per-command latency percentiles.
+ *
+ * It can also generate a mail store to run the server against:
+ *
+ *     ./popload -g /tmp/load -U 2000 -M 50 -s 4096
+ *     (cd /tmp/load && /path/to/mypopd 2525) &
+ *     ./popload -p 2525 -c 2000 -n 100000 -U 2000 -M 50 -x stat=1,list=1,retr=4,dele=1
+ *
+ * Concurrent sessions log in as different users, as a maildrop can
+ * only be opened by one session at a time; -U defaults to -c.
+ */
+
+#include "histogram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_EVENTS 256
+#define RECV_SIZE  65536
+
+typedef enum command {
+    CMD_CONNECT, CMD_USER, CMD_PASS, CMD_STAT, CMD_LIST, CMD_RETR,
+    CMD_DELE, CMD_RSET, CMD_QUIT, NUM_COMMANDS
+} command;
+
+static const char *command_names[NUM_COMMANDS] = {
+    "CONNECT", "USER", "PASS", "STAT", "LIST", "RETR", "DELE", "RSET", "QUIT"
+};
+
+typedef struct session {
+    int fd;
+    int user;
+    int remaining;          // Commands of the mix still to be sent
+    int deleted;            // Whether a DELE was sent (RSET before QUIT)
+    int commands;           // Commands answered in this session
+    command current;
+    int multiline;          // Current response may span several lines
+    int status;             // 0 until the status line is read, then '+' or '-'
+    char tail[4];           // Last bytes of the response, to find ".\r\n"
+    uint64_t started;
+    char out[64];
+    size_t out_len, out_sent;
+    int want_out;           // Registered for EPOLLOUT
+} session;
+
+static const char *host = "localhost";
+static const char *port = NULL;
+static int concurrency = 100;
+static long total_sessions = 1000;
+static double duration = 0;
+static int users = 0;               // 0: one per concurrent session
+static int messages = 10;
+static int commands_per_session = 5;
+static int keep_store = 1;
+static int weights[NUM_COMMANDS];
+static int total_weight;
+
+static struct addrinfo *server_addr;
+static int epfd;
+static histogram latency[NUM_COMMANDS];
+static unsigned long errors[NUM_COMMANDS];
+static unsigned long sessions_started, sessions_done, sessions_failed;
+static unsigned long long commands_done;
+static int *user_sessions;          // Active sessions per user
+static int active_sessions;
+static unsigned long long bytes_sent, bytes_received;
+static unsigned int seed = 1;
+static uint64_t deadline;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -p port [-h host] [-c concurrency] [-n sessions | -d seconds]\n"
+            "          [-U users] [-M messages] [-k commands] [-x mix] [-D]\n"
+            "   or: %s -g dir [-U users] [-M messages] [-s message_size]\n"
+            "\n"
+            "  -U users  number of users (default: the concurrency)\n"
+            "  -x mix  weights of the commands sent after login, e.g. stat=1,list=1,retr=2,dele=1\n"
+            "  -D      let DELE commands take effect (by default sessions RSET before QUIT)\n"
+            "  -g dir  create dir/users.txt and dir/mail.store (flat layout) and exit\n",
+            prog, prog);
+    exit(1);
+}
+
+static void parse_mix(const char *mix) {
+    char *copy = strdup(mix), *save = NULL;
+    memset(weights, 0, sizeof(weights));
+    for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        int weight = eq ? atoi(eq + 1) : 1;
+        if (eq) *eq = 0;
+        int cmd;
+        for (cmd = CMD_STAT; cmd <= CMD_DELE; cmd++)
+            if (!strcasecmp(tok, command_names[cmd]))
+                break;
+        if (cmd > CMD_DELE || weight < 0) {
+            fprintf(stderr, "Invalid command in mix: %s\n", tok);
+            exit(1);
+        }
+        weights[cmd] = weight;
+    }
+    free(copy);
+    total_weight = 0;
+    for (int cmd = 0; cmd < NUM_COMMANDS; cmd++)
+        total_weight += weights[cmd];
+    if (!total_weight) {
+        fprintf(stderr, "Command mix is empty\n");
+        exit(1);
+    }
+}
+
+static command pick_command(void) {
+    int r = rand_r(&seed) % total_weight;
+    for (int cmd = CMD_STAT; cmd <= CMD_DELE; cmd++) {
+        if (r < weights[cmd])
+            return cmd;
+        r -= weights[cmd];
+    }
+    return CMD_STAT;
+}
+
+/* Creates users.txt and a flat mail store with the same message for
+ * every user (hard links to a single file, like save_user_mail). */
+static int generate_store(const char *dir, int size) {
+    char path[4096], base[4096];
+
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/users.txt", dir);
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+    for (int u = 0; u < users; u++)
+        fprintf(file, "user%d@example.com pass%d\n", u, u);
+    fclose(file);
+
+    snprintf(base, sizeof(base), "%s/.template.mail", dir);
+    file = fopen(base, "w");
+    if (!file) {
+        perror(base);
+        return 1;
+    }
+    int written = fprintf(file, "From: Load Generator <load@example.com>\nSubject: Test message\n\n");
+    for (int line = 0; written < size; line++) {
+        // Every tenth line starts with a dot, to exercise byte-stuffing
+        int len = line % 10 == 9 ? fprintf(file, ".%.*s\n", 70, "The quick brown fox jumps over the lazy dog, again and again and again.")
+                                 : fprintf(file, "%.*s\n", 71, "The quick brown fox jumps over the lazy dog, again and again and again.");
+        written += len;
+    }
+    fclose(file);
+
+    snprintf(path, sizeof(path), "%s/mail.store", dir);
+    mkdir(path, 0777);
+    for (int u = 0; u < users; u++) {
+        snprintf(path, sizeof(path), "%s/mail.store/user%d@example.com", dir, u);
+        mkdir(path, 0777);
+        for (int m = 0; m < messages; m++) {
+            snprintf(path, sizeof(path), "%s/mail.store/user%d@example.com/%d.mail", dir, u, m);
+            if (link(base, path) < 0 && errno != EEXIST) {
+                perror(path);
+                return 1;
+            }
+        }
+    }
+    unlink(base);
+    printf("Created %d users with %d messages of %d bytes in %s\n", users, messages, written, dir);
+    return 0;
+}
+
+/* Picks a user no other active session is logged in as, if there is
+ * one, so that sessions do not fail on each other's maildrop locks. */
+static int user_acquire(void) {
+    int user = rand_r(&seed) % users;
+    for (int i = 0; i < users && user_sessions[user]; i++)
+        user = (user + 1) % users;
+    user_sessions[user]++;
+    return user;
+}
+
+static void session_close(session *s, int failed) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->fd = -1;
+    active_sessions--;
+    user_sessions[s->user]--;
+    if (failed) {
+        sessions_failed++;
+        errors[s->current]++;
+    } else {
+        sessions_done++;
+        commands_done += s->commands;
+    }
+}
+
+static int session_start(session *s);
+
+/* Abandons a session after an error and starts a new one in its place. */
+static void session_fail(session *s) {
+    session_close(s, 1);
+    session_start(s);
+}
+
+static int session_start(session *s) {
+    while (1) {
+        if ((deadline && now_us() >= deadline) ||
+            (!deadline && sessions_started >= (unsigned long) total_sessions))
+            return 0;
+
+        s->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (s->fd < 0) {
+            perror("socket");
+            return 0;
+        }
+        int one = 1;
+        setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sessions_started++;
+        s->user = user_acquire();
+        s->remaining = commands_per_session;
+        s->deleted = 0;
+        s->commands = 0;
+        s->current = CMD_CONNECT;
+        s->multiline = 0;
+        s->status = 0;
+        memset(s->tail, 0, sizeof(s->tail));
+        s->out_len = s->out_sent = 0;
+        s->want_out = 1;    // Connection completion is reported as EPOLLOUT
+        s->started = now_us();
+
+        if (connect(s->fd, server_addr->ai_addr, server_addr->ai_addrlen) == 0 || errno == EINPROGRESS)
+            break;
+        close(s->fd);
+        s->fd = -1;
+        user_sessions[s->user]--;
+        sessions_failed++;
+        errors[CMD_CONNECT]++;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = s };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev);
+    active_sessions++;
+    return 1;
+}
+
+/* Sends whatever is pending. Waits for EPOLLOUT only while a command
+ * cannot be sent in full, which is rare for short commands. */
+static void session_flush(session *s) {
+    while (s->out_sent < s->out_len) {
+        ssize_t rv = send(s->fd, s->out + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL);
+        if (rv < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                session_fail(s);
+            else if (!s->want_out) {
+                struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = s };
+                epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+                s->want_out = 1;
+            }
+            return;
+        }
+        s->out_sent += rv;
+        bytes_sent += rv;
+    }
+    if (s->want_out) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+        s->want_out = 0;
+    }
+}
+
+static void session_send(session *s, command cmd) {
+    int msg = 1 + rand_r(&seed) % messages;
+    s->current = cmd;
+    s->status = 0;
+    memset(s->tail, 0, sizeof(s->tail));
+    switch (cmd) {
+    case CMD_USER: s->out_len = sprintf(s->out, "USER user%d@example.com\r\n", s->user); break;
+    case CMD_PASS: s->out_len = sprintf(s->out, "PASS pass%d\r\n", s->user); break;
+    case CMD_STAT: s->out_len = sprintf(s->out, "STAT\r\n"); break;
+    case CMD_LIST: s->out_len = sprintf(s->out, "LIST\r\n"); break;
+    case CMD_RETR: s->out_len = sprintf(s->out, "RETR %d\r\n", msg); break;
+    case CMD_DELE: s->out_len = sprintf(s->out, "DELE %d\r\n", msg); s->deleted = 1; break;
+    case CMD_RSET: s->out_len = sprintf(s->out, "RSET\r\n"); break;
+    default:       s->out_len = sprintf(s->out, "QUIT\r\n"); break;
+    }
+    s->multiline = cmd == CMD_LIST || cmd == CMD_RETR;
+    s->out_sent = 0;
+    s->started = now_us();
+    session_flush(s);
+}
+
+/* Called once the response to the current command is complete. */
+static void session_next(session *s) {
+    hist_record(&latency[s->current], now_us() - s->started);
+    if (s->current != CMD_CONNECT)
+        s->commands++;
+    if (s->current == CMD_PASS && s->status != '+') {
+        // Without a login (e.g. the maildrop is locked) the session did
+        // none of the work being measured.
+        session_fail(s);
+        return;
+    }
+    if (s->status != '+')
+        errors[s->current]++;
+
+    switch (s->current) {
+    case CMD_CONNECT: session_send(s, CMD_USER); break;
+    case CMD_USER:    session_send(s, CMD_PASS); break;
+    case CMD_QUIT:
+        session_close(s, 0);
+        session_start(s);
+        break;
+    default:
+        if (s->remaining-- > 0)
+            session_send(s, pick_command());
+        else if (s->deleted && keep_store && s->current != CMD_RSET)
+            session_send(s, CMD_RSET);
+        else
+            session_send(s, CMD_QUIT);
+    }
+}
+
+/* Consumes received bytes. Returns 1 if the response is complete. */
+static int session_consume(session *s, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!s->status)
+            s->status = data[i];
+        memmove(s->tail, s->tail + 1, 3);
+        s->tail[3] = data[i];
+        if (data[i] != '\n')
+            continue;
+        // A single-line response (or an error) ends with the first line.
+        if (!s->multiline || s->status != '+')
+            return i + 1 == len ? 1 : -1;
+        if (!memcmp(s->tail, "\n.\r\n", 4))
+            return i + 1 == len ? 1 : -1;
+    }
+    return 0;
+}
+
+static void session_read(session *s) {
+    static char buf[RECV_SIZE];
+    while (1) {
+        ssize_t rv = recv(s->fd, buf, sizeof(buf), 0);
+        if (rv < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                session_fail(s);
+            return;
+        }
+        if (rv == 0) {
+            session_close(s, s->current != CMD_QUIT);
+            session_start(s);
+            return;
+        }
+        bytes_received += rv;
+        int done = session_consume(s, buf, rv);
+        if (done < 0) {
+            // The server sent more than one response; the replay is
+            // strictly request/response, so this is a protocol error.
+            session_fail(s);
+            return;
+        }
+        if (done) {
+            session_next(s);
+            return;
+        }
+    }
+}
+
+static void print_report(double elapsed) {
+    // Throughput counts only the sessions that completed.
+    printf("%lu sessions (%lu failed) in %.2f s: %.1f sessions/s, %.1f commands/s, "
+           "%.1f KB/s received, %.1f KB/s sent\n",
+           sessions_done, sessions_failed, elapsed, sessions_done / elapsed, commands_done / elapsed,
+           bytes_received / elapsed / 1024, bytes_sent / elapsed / 1024);
+    printf("%-8s %10s %8s %10s %10s %10s %10s %10s\n",
+           "command", "count", "errors", "mean(us)", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (int cmd = 0; cmd < NUM_COMMANDS; cmd++) {
+        histogram *h = &latency[cmd];
+        if (!h->count && !errors[cmd])
+            continue;
+        printf("%-8s %10llu %8lu %10llu %10llu %10llu %10llu %10llu\n",
+               command_names[cmd], (unsigned long long) h->count, errors[cmd],
+               (unsigned long long) (h->count ? h->sum / h->count : 0),
+               (unsigned long long) hist_percentile(h, 50),
+               (unsigned long long) hist_percentile(h, 99),
+               (unsigned long long) hist_percentile(h, 99.9),
+               (unsigned long long) h->max);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *generate = NULL;
+    int message_size = 2048;
+    int opt;
+
+    parse_mix("stat=1,list=1,retr=2");
+    while ((opt = getopt(argc, argv, "h:p:c:n:d:U:M:k:x:Dg:s:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'c': concurrency = atoi(optarg); break;
+        case 'n': total_sessions = atol(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'U': users = atoi(optarg); break;
+        case 'M': messages = atoi(optarg); break;
+        case 'k': commands_per_session = atoi(optarg); break;
+        case 'x': parse_mix(optarg); break;
+        case 'D': keep_store = 0; break;
+        case 'g': generate = optarg; break;
+        case 's': message_size = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || users < 0 || messages <= 0 || concurrency <= 0)
+        usage(argv[0]);
+    if (!users)
+        users = concurrency;
+    if (generate)
+        return generate_store(generate, message_size);
+    if (!port)
+        usage(argv[0]);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &server_addr) != 0) {
+        fprintf(stderr, "Cannot resolve %s:%s\n", host, port);
+        return 1;
+    }
+
+    // Each session needs a descriptor; raise the limit as far as allowed.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (users < concurrency)
+        fprintf(stderr, "Warning: %d users for %d concurrent sessions; some logins will "
+                "fail on locked maildrops\n", users, concurrency);
+    user_sessions = calloc(users, sizeof(int));
+
+    epfd = epoll_create1(0);
+    session *sessions = calloc(concurrency, sizeof(session));
+    uint64_t start = now_us();
+    if (duration > 0)
+        deadline = start + (uint64_t) (duration * 1000000);
+
+    for (int i = 0; i < concurrency; i++) {
+        sessions[i].fd = -1;
+        session_start(&sessions[i]);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (active_sessions > 0) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        for (int i = 0; i < n; i++) {
+            session *s = events[i].data.ptr;
+            if (s->fd < 0)
+                continue;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                session_fail(s);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT && s->want_out)
+                session_flush(s);
+            if (s->fd >= 0 && events[i].events & EPOLLIN)
+                session_read(s);
+        }
+    }
+
+    print_report((now_us() - start) / 1e6);
+    free(sessions);
+    free(user_sessions);
+    freeaddrinfo(server_addr);
+    close(epfd);
+    return 0;
+}
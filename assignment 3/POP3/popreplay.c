@@ -0,0 +1,631 @@
+/* popreplay.c
+ * Replays the sessions of a capture file (see capture.h) against a
+ * server, keeping their original timing: every session connects at
+ * its recorded offset from the start of the capture, and sends each
+ * command at its recorded time or as soon as the previous response is
+ * complete, whichever is later. All times can be compressed by a speed
+ * factor. Responses are compared with the recorded ones (status line,
+ * length and hash), and per-command latency percentiles are reported.
+ *
+ *     (cd /tmp/load && /path/to/mypopd -R /tmp/mypopd.cap 2525) &
+ *     ./popload -p 2525 -c 50 -d 30 -U 100 -M 20
+ *     # Restart the server on an unchanged copy of the mail store, then
+ *     ./popreplay -p 2525 -s 10 /tmp/mypopd.cap
+ *
+ * Like popload, it runs one epoll loop over non-blocking sockets.
+ */
+
+#include "capture.h"
+#include "histogram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_EVENTS     256
+#define RECV_SIZE      65536
+#define MAX_MISMATCHES 10
+
+typedef enum command {
+    CMD_CONNECT, CMD_USER, CMD_PASS, CMD_STAT, CMD_LIST, CMD_UIDL, CMD_RETR, CMD_TOP,
+    CMD_DELE, CMD_RSET, CMD_NOOP, CMD_QUIT, CMD_OTHER, NUM_COMMANDS
+} command;
+
+static const char *command_names[NUM_COMMANDS] = {
+    "CONNECT", "USER", "PASS", "STAT", "LIST", "UIDL", "RETR", "TOP",
+    "DELE", "RSET", "NOOP", "QUIT", "other"
+};
+
+/* A recorded command and the summary of its response. */
+typedef struct step {
+    uint64_t time_us;
+    const char *line;           // Points into the capture, not terminated
+    uint32_t line_len;
+    command cmd;
+    int multiline;              // A positive response spans several lines
+    int recorded;               // Whether the response was recorded
+    capture_response expected;
+    const char *expected_line;
+    uint32_t expected_line_len;
+} step;
+
+typedef enum phase { CONNECTING, GREETING, WAITING, RESPONSE, DONE } phase;
+
+typedef struct session {
+    uint64_t id;
+    uint64_t open_us;
+    step *steps;
+    size_t count, capacity;
+
+    int fd;
+    phase phase;
+    size_t next;                // Step being sent or waited for
+    uint64_t due;               // When the next command is to be sent
+    uint64_t started;           // When the current command was sent
+    size_t out_sent;
+    int want_out;
+    int status;                 // 0 until the status line starts, then '+' or '-'
+    char tail[4];               // Last bytes of the response, to find ".\r\n"
+    uint64_t bytes, hash;
+    int line_done;
+    size_t line_len;
+    char line[CAPTURE_LINE_SIZE];
+} session;
+
+static const char *host = "localhost";
+static const char *port = NULL;
+static double speed = 1;
+static int status_only = 0;
+static int response_timeout = 10;
+
+static struct addrinfo *server_addr;
+static int epfd;
+static histogram latency[NUM_COMMANDS];
+static histogram lateness;
+static unsigned long errors[NUM_COMMANDS];
+static unsigned long mismatches, unchecked;
+static unsigned long sessions_done, sessions_failed, timeouts;
+static int active_sessions;
+static uint64_t replay_start;
+
+// Sessions waiting to send their next command, as a binary heap on due.
+static session **timers;
+static size_t timer_count;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Time at which something recorded at time_us is due in the replay. */
+static uint64_t scaled(uint64_t time_us) {
+    return replay_start + (uint64_t) (time_us / speed);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -p port [-h host] [-s speed] [-t seconds] [-S] capture_file\n"
+            "\n"
+            "  -s speed  replay this many times faster than recorded (default 1)\n"
+            "  -t secs   give up on a session whose server does not answer (default 10)\n"
+            "  -S        compare only the status (+OK or -ERR) of responses, e.g. if\n"
+            "            the server does not run on the captured mail store\n",
+            prog);
+    exit(1);
+}
+
+static void timer_push(session *s) {
+    size_t i = timer_count++;
+    while (i > 0 && timers[(i - 1) / 2]->due > s->due) {
+        timers[i] = timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    timers[i] = s;
+}
+
+static session *timer_pop(void) {
+    session *top = timers[0], *last = timers[--timer_count];
+    size_t i = 0;
+    while (2 * i + 1 < timer_count) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < timer_count && timers[child + 1]->due < timers[child]->due)
+            child++;
+        if (last->due <= timers[child]->due)
+            break;
+        timers[i] = timers[child];
+        i = child;
+    }
+    if (timer_count)
+        timers[i] = last;
+    return top;
+}
+
+/* Classifies a command line, and tells whether a positive response to
+ * it is multi-line. */
+static command parse_command(const char *line, size_t len, int *multiline) {
+    char verb[8];
+    size_t n = 0;
+    while (n < len && n < sizeof(verb) - 1 && isalpha((unsigned char) line[n])) {
+        verb[n] = line[n];
+        n++;
+    }
+    verb[n] = 0;
+    int has_argument = n < len && line[n] == ' ';
+
+    command cmd;
+    for (cmd = CMD_USER; cmd < CMD_OTHER; cmd++)
+        if (!strcasecmp(verb, command_names[cmd]))
+            break;
+    *multiline = cmd == CMD_RETR || cmd == CMD_TOP || !strcasecmp(verb, "CAPA") ||
+                 ((cmd == CMD_LIST || cmd == CMD_UIDL) && !has_argument);
+    return cmd;
+}
+
+static session *find_session(session **sessions, size_t *count, size_t *capacity, uint64_t id) {
+    // Session ids are handed out in order, so they index the array.
+    if (id == 0 || id > (1u << 30))
+        return NULL;
+    if (id > *capacity) {
+        size_t capacity2 = *capacity ? *capacity : 1024;
+        while (capacity2 < id)
+            capacity2 *= 2;
+        *sessions = realloc(*sessions, capacity2 * sizeof(session));
+        memset(*sessions + *capacity, 0, (capacity2 - *capacity) * sizeof(session));
+        *capacity = capacity2;
+    }
+    if (id > *count)
+        *count = id;
+    return &(*sessions)[id - 1];
+}
+
+/* Reads a capture file into sessions, in the order they started.
+ * Returns the number of sessions, or -1 on error. */
+static long load_capture(const char *path, char **data, session **result) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+    *data = malloc(st.st_size + 1);
+    size_t size = 0;
+    while (size < (size_t) st.st_size) {
+        ssize_t n = read(fd, *data + size, st.st_size - size);
+        if (n <= 0)
+            break;
+        size += n;
+    }
+    close(fd);
+    if (size < strlen(CAPTURE_MAGIC) || memcmp(*data, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC))) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        return -1;
+    }
+
+    session *sessions = NULL;
+    size_t count = 0, capacity = 0;
+    size_t offset = strlen(CAPTURE_MAGIC);
+    while (offset + sizeof(capture_record) <= size) {
+        capture_record header;
+        memcpy(&header, *data + offset, sizeof(header));
+        const char *body = *data + offset + sizeof(header);
+        if (header.length > size - offset - sizeof(header))
+            break;      // Cut short, e.g. by a server killed while writing
+        offset += sizeof(header) + header.length;
+
+        session *s = find_session(&sessions, &count, &capacity, header.session);
+        if (!s)
+            continue;
+        if (header.type == CAP_OPEN) {
+            s->id = header.session;
+            s->open_us = header.time_us;
+        } else if (!s->id) {
+            continue;   // Opened before the capture started
+        } else if (header.type == CAP_COMMAND) {
+            if (s->count == s->capacity) {
+                s->capacity = s->capacity ? 2 * s->capacity : 8;
+                s->steps = realloc(s->steps, s->capacity * sizeof(step));
+            }
+            step *st = &s->steps[s->count++];
+            memset(st, 0, sizeof(*st));
+            st->time_us = header.time_us;
+            st->line = body;
+            st->line_len = header.length;
+            st->cmd = parse_command(body, header.length, &st->multiline);
+        } else if (header.type == CAP_RESPONSE && s->count &&
+                   header.length >= sizeof(capture_response)) {
+            step *st = &s->steps[s->count - 1];
+            st->recorded = 1;
+            memcpy(&st->expected, body, sizeof(st->expected));
+            st->expected_line = body + sizeof(st->expected);
+            st->expected_line_len = header.length - sizeof(st->expected);
+        }
+    }
+    if (offset != size)
+        fprintf(stderr, "%s: ignoring %zu bytes of a truncated record\n", path, size - offset);
+
+    // Records were written in time order, so sessions are too, except
+    // for ids taken just before another session's open was recorded.
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++)
+        if (sessions[i].id)
+            sessions[kept++] = sessions[i];
+    for (size_t i = 1; i < kept; i++) {
+        session s = sessions[i];
+        size_t j = i;
+        for (; j > 0 && sessions[j - 1].open_us > s.open_us; j--)
+            sessions[j] = sessions[j - 1];
+        sessions[j] = s;
+    }
+    *result = sessions;
+    return kept;
+}
+
+static void session_close(session *s, int failed) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->fd = -1;
+    active_sessions--;
+    if (failed) {
+        sessions_failed++;
+        errors[s->phase == RESPONSE ? s->steps[s->next].cmd : CMD_CONNECT]++;
+    } else
+        sessions_done++;
+    s->phase = DONE;
+}
+
+static void session_start(session *s) {
+    s->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (s->fd < 0) {
+        perror("socket");
+        sessions_failed++;
+        errors[CMD_CONNECT]++;
+        return;
+    }
+    int one = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    s->phase = CONNECTING;
+    s->next = 0;
+    s->want_out = 1;    // Connection completion is reported as EPOLLOUT
+    s->started = now_us();
+    if (connect(s->fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(s->fd);
+        s->fd = -1;
+        s->phase = DONE;
+        sessions_failed++;
+        errors[CMD_CONNECT]++;
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = s };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev);
+    active_sessions++;
+}
+
+static void session_expect(session *s) {
+    s->status = 0;
+    memset(s->tail, 0, sizeof(s->tail));
+    s->bytes = 0;
+    s->hash = CAPTURE_HASH_INIT;
+    s->line_done = 0;
+    s->line_len = 0;
+}
+
+/* Sends whatever is left of the current command. */
+static void session_flush(session *s) {
+    step *st = &s->steps[s->next];
+    while (s->out_sent < st->line_len) {
+        ssize_t rv = send(s->fd, st->line + s->out_sent, st->line_len - s->out_sent, MSG_NOSIGNAL);
+        if (rv < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                session_close(s, 1);
+            else if (!s->want_out) {
+                struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = s };
+                epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+                s->want_out = 1;
+            }
+            return;
+        }
+        s->out_sent += rv;
+    }
+    if (s->want_out) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+        s->want_out = 0;
+    }
+}
+
+static void session_send(session *s) {
+    uint64_t now = now_us();
+    hist_record(&lateness, now > s->due ? now - s->due : 0);
+    s->phase = RESPONSE;
+    s->started = now;
+    s->out_sent = 0;
+    session_expect(s);
+    session_flush(s);
+}
+
+/* Moves on to the next recorded command, now or when it is due. */
+static void session_schedule(session *s) {
+    if (s->next >= s->count) {
+        session_close(s, 0);
+        return;
+    }
+    s->due = scaled(s->steps[s->next].time_us);
+    if (s->due <= now_us())
+        session_send(s);
+    else {
+        s->phase = WAITING;
+        timer_push(s);
+    }
+}
+
+static void print_line(const char *label, const char *line, size_t len) {
+    printf("    %s %.*s\n", label, (int) len, line);
+}
+
+static void check_response(session *s) {
+    step *st = &s->steps[s->next];
+    if (!st->recorded) {
+        unchecked++;
+        return;
+    }
+    int same;
+    if (status_only)
+        same = st->expected_line_len && s->line_len && st->expected_line[0] == s->line[0];
+    else
+        same = st->expected.bytes == s->bytes && st->expected.hash == s->hash;
+    if (same)
+        return;
+    if (mismatches++ < MAX_MISMATCHES) {
+        // Passwords are not printed.
+        size_t shown = st->line_len;
+        while (shown > 0 && (st->line[shown - 1] == '\r' || st->line[shown - 1] == '\n'))
+            shown--;
+        printf("Session %llu, command %zu: %.*s\n", (unsigned long long) s->id, s->next + 1,
+               st->cmd == CMD_PASS ? 4 : (int) shown, st->line);
+        print_line("expected:", st->expected_line, st->expected_line_len);
+        printf("              (%llu bytes)\n", (unsigned long long) st->expected.bytes);
+        print_line("received:", s->line, s->line_len);
+        printf("              (%llu bytes)\n", (unsigned long long) s->bytes);
+    }
+}
+
+/* Consumes received bytes. Returns 1 if the response is complete, -1
+ * if more than the response was received. */
+static int session_consume(session *s, const char *data, size_t len, int multiline) {
+    for (size_t i = 0; i < len; i++) {
+        if (!s->status)
+            s->status = data[i];
+        memmove(s->tail, s->tail + 1, 3);
+        s->tail[3] = data[i];
+        if (data[i] == '\r' || data[i] == '\n')
+            s->line_done = 1;
+        else if (!s->line_done && s->line_len < CAPTURE_LINE_SIZE)
+            s->line[s->line_len++] = data[i];
+        if (data[i] != '\n')
+            continue;
+        if (!multiline || s->status != '+' || !memcmp(s->tail, "\n.\r\n", 4)) {
+            s->bytes += i + 1;
+            s->hash = capture_hash(s->hash, data, i + 1);
+            return i + 1 == len ? 1 : -1;
+        }
+    }
+    s->bytes += len;
+    s->hash = capture_hash(s->hash, data, len);
+    return 0;
+}
+
+static void session_read(session *s) {
+    static char buf[RECV_SIZE];
+    while (1) {
+        ssize_t rv = recv(s->fd, buf, sizeof(buf), 0);
+        if (rv < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                session_close(s, 1);
+            return;
+        }
+        if (rv == 0) {
+            // The server may close the connection after the last
+            // response, as it does after QUIT.
+            session_close(s, s->phase != WAITING || s->next < s->count);
+            return;
+        }
+        if (s->phase != GREETING && s->phase != RESPONSE) {
+            session_close(s, 1);
+            return;
+        }
+        int multiline = s->phase == RESPONSE && s->steps[s->next].multiline;
+        int done = session_consume(s, buf, rv, multiline);
+        if (done < 0) {
+            // Commands are sent one at a time, so there can be no more
+            // than one response.
+            session_close(s, 1);
+            return;
+        }
+        if (!done)
+            continue;
+
+        uint64_t elapsed = now_us() - s->started;
+        if (s->phase == GREETING) {
+            // The greeting is not recorded, only timed.
+            hist_record(&latency[CMD_CONNECT], elapsed);
+            if (s->status != '+')
+                errors[CMD_CONNECT]++;
+        } else {
+            step *st = &s->steps[s->next];
+            hist_record(&latency[st->cmd], elapsed);
+            if (s->status != '+')
+                errors[st->cmd]++;
+            check_response(s);
+            s->next++;
+        }
+        session_schedule(s);
+        return;
+    }
+}
+
+static void print_report(long sessions, double elapsed) {
+    unsigned long long commands = 0;
+    for (int cmd = CMD_USER; cmd < NUM_COMMANDS; cmd++)
+        commands += latency[cmd].count;
+
+    printf("%ld sessions replayed (%lu failed, %lu timed out), %llu commands in %.2f s at %gx speed\n",
+           sessions, sessions_failed, timeouts, commands, elapsed, speed);
+    printf("%lu responses differ from the capture%s, %lu were not recorded\n",
+           mismatches, status_only ? " (status only)" : "", unchecked);
+    printf("Commands sent late: p50 %llu us, p99 %llu us, max %llu us\n",
+           (unsigned long long) hist_percentile(&lateness, 50),
+           (unsigned long long) hist_percentile(&lateness, 99),
+           (unsigned long long) lateness.max);
+    printf("%-8s %10s %8s %10s %10s %10s %10s %10s\n",
+           "command", "count", "-ERR", "mean(us)", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (int cmd = 0; cmd < NUM_COMMANDS; cmd++) {
+        histogram *h = &latency[cmd];
+        if (!h->count && !errors[cmd])
+            continue;
+        printf("%-8s %10llu %8lu %10llu %10llu %10llu %10llu %10llu\n",
+               command_names[cmd], (unsigned long long) h->count, errors[cmd],
+               (unsigned long long) (h->count ? h->sum / h->count : 0),
+               (unsigned long long) hist_percentile(h, 50),
+               (unsigned long long) hist_percentile(h, 99),
+               (unsigned long long) hist_percentile(h, 99.9),
+               (unsigned long long) h->max);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:s:t:S")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 's': speed = atof(optarg); break;
+        case 't': response_timeout = atoi(optarg); break;
+        case 'S': status_only = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || !port || speed <= 0 || response_timeout <= 0)
+        usage(argv[0]);
+
+    char *data;
+    session *sessions;
+    long count = load_capture(argv[optind], &data, &sessions);
+    if (count < 0)
+        return 1;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &server_addr) != 0) {
+        fprintf(stderr, "Cannot resolve %s:%s\n", host, port);
+        return 1;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // Commands may be due within less than the millisecond resolution
+    // of epoll_wait(), so the loop sleeps on a timer instead.
+    epfd = epoll_create1(0);
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct epoll_event timer_ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, timer, &timer_ev);
+    timers = malloc((count ? count : 1) * sizeof(*timers));
+    // The replay starts with the first session, not with the capture.
+    uint64_t first = count ? sessions[0].open_us : 0;
+    replay_start = now_us() - (uint64_t) (first / speed);
+    uint64_t start = now_us();
+
+    struct epoll_event events[MAX_EVENTS];
+    long opened = 0;
+    uint64_t last_check = start, armed = 0;
+    while (opened < count || active_sessions > 0) {
+        uint64_t now = now_us();
+        while (opened < count && scaled(sessions[opened].open_us) <= now)
+            session_start(&sessions[opened++]);
+        while (timer_count && timers[0]->due <= now) {
+            session *s = timer_pop();
+            if (s->phase == WAITING)    // Not closed by the server meanwhile
+                session_send(s);
+        }
+
+        if (now - last_check >= 1000000) {
+            for (long i = 0; i < opened; i++) {
+                session *s = &sessions[i];
+                if (s->fd >= 0 && s->phase != WAITING &&
+                    now >= s->started + (uint64_t) response_timeout * 1000000) {
+                    timeouts++;
+                    session_close(s, 1);
+                }
+            }
+            last_check = now;
+        }
+
+        uint64_t next = last_check + 1000000;
+        if (opened < count && scaled(sessions[opened].open_us) < next)
+            next = scaled(sessions[opened].open_us);
+        if (timer_count && timers[0]->due < next)
+            next = timers[0]->due;
+        if (next <= now)
+            continue;
+        if (next != armed) {
+            struct itimerspec when = { { 0, 0 }, { next / 1000000, next % 1000000 * 1000 } };
+            timerfd_settime(timer, TFD_TIMER_ABSTIME, &when, NULL);
+            armed = next;
+        }
+
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            session *s = events[i].data.ptr;
+            if (!s) {
+                uint64_t expirations;
+                read(timer, &expirations, sizeof(expirations));
+                continue;
+            }
+            if (s->fd < 0)
+                continue;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                session_close(s, 1);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT && s->want_out) {
+                if (s->phase == CONNECTING) {
+                    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+                    epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+                    s->want_out = 0;
+                    s->phase = GREETING;
+                    session_expect(s);
+                } else
+                    session_flush(s);
+            }
+            if (s->fd >= 0 && events[i].events & EPOLLIN)
+                session_read(s);
+        }
+    }
+
+    print_report(count, (now_us() - start) / 1e6);
+    freeaddrinfo(server_addr);
+    close(timer);
+    close(epfd);
+    return 0;
+}
@@ -0,0 +1,267 @@
+/* ratelimit.c
+ * Per-client-address token buckets.
+ *
+ * The table is split in shards selected by a hash of the address, each
+ * with its own small lock, so clients that hash to different shards
+ * never wait for each other and the accept loop only ever holds one
+ * shard lock for a few hundred nanoseconds. An entry whose buckets
+ * have refilled completely carries no information, so a shard that
+ * reaches its size limit drops such entries, one hash chain per new
+ * client. If that frees nothing the new client is not tracked (and
+ * not limited) rather than growing the table without bound.
+ *
+ * IPv6 clients are limited per /64, the smallest network usually
+ * assigned to a single host.
+ *
+ * The limits themselves are replaced as a whole on reload, under a
+ * write lock; each check works on a copy taken under the read lock, so
+ * it never pairs a new rate with an old burst.
+ */
+
+#include "ratelimit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define SHARDS          64
+#define SHARD_BUCKETS   1024
+#define SHARD_MAX_ITEMS 2048    // Two entries per hash chain
+
+struct bucket {
+    double tokens;
+    uint64_t updated;   // Time of the last refill, in nanoseconds
+};
+
+struct client {
+    unsigned char addr[16];
+    struct bucket connections;
+    struct bucket auth_failures;
+    struct client *next;
+};
+
+struct shard {
+    pthread_mutex_t lock;
+    int items;
+    int sweep_next;     // Next hash chain for shard_sweep()
+    struct client *buckets[SHARD_BUCKETS];
+};
+
+struct limits {
+    rate_limit connections;
+    rate_limit auth_failures;
+};
+
+static struct limits limits;
+static pthread_rwlock_t limits_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct shard shards[SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void shards_init(void) {
+    for (int i = 0; i < SHARDS; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+static void limits_get(struct limits *l) {
+    pthread_rwlock_rdlock(&limits_lock);
+    *l = limits;
+    pthread_rwlock_unlock(&limits_lock);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Parses a limit written as "rate" or "rate:burst" (the burst
+ *  defaults to the rate, and is at least one token).
+ *
+ *  Returns: 0 on success, -1 if the specification is invalid.
+ */
+int ratelimit_parse(const char *spec, rate_limit *limit) {
+    char extra;
+    int n = sscanf(spec, "%lf:%lf%c", &limit->rate, &limit->burst, &extra);
+    if (n == 1)
+        limit->burst = limit->rate;
+    else if (n != 2)
+        return -1;
+    if (limit->rate < 0 || limit->burst < 0)
+        return -1;
+    if (limit->burst < 1)
+        limit->burst = 1;
+    return 0;
+}
+
+/** Sets the limits for new connections and for failed logins. Either
+ *  may be NULL to leave it unchanged.
+ */
+void ratelimit_configure(const rate_limit *connections, const rate_limit *auth_failures) {
+    pthread_once(&shards_once, shards_init);
+    pthread_rwlock_wrlock(&limits_lock);
+    if (connections)
+        limits.connections = *connections;
+    if (auth_failures)
+        limits.auth_failures = *auth_failures;
+    pthread_rwlock_unlock(&limits_lock);
+}
+
+/* Normalizes an address to 16 bytes (IPv4 as IPv4-mapped IPv6, IPv6
+ * as its /64 prefix). */
+static int address_key(const struct sockaddr *addr, unsigned char key[16]) {
+    if (addr->sa_family == AF_INET) {
+        memset(key, 0, 10);
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+        return 0;
+    }
+    if (addr->sa_family == AF_INET6) {
+        const struct in6_addr *in6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+        memcpy(key, in6, 16);
+        if (!IN6_IS_ADDR_V4MAPPED(in6))
+            memset(key + 8, 0, 8);
+        return 0;
+    }
+    return -1;
+}
+
+static uint32_t key_hash(const unsigned char key[16]) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 16; i++) {
+        h ^= key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void refill(struct bucket *b, const rate_limit *limit, uint64_t now) {
+    b->tokens += limit->rate * (now - b->updated) / 1e9;
+    if (b->tokens > limit->burst)
+        b->tokens = limit->burst;
+    b->updated = now;
+}
+
+/* Drops the entries of the next hash chain whose buckets are full
+ * again, so a lookup never walks more than one chain. Called with the
+ * shard locked. */
+static void shard_sweep(struct shard *shard, const struct limits *l, uint64_t now) {
+    struct client **prev = &shard->buckets[shard->sweep_next];
+    shard->sweep_next = (shard->sweep_next + 1) % SHARD_BUCKETS;
+    while (*prev) {
+        struct client *c = *prev;
+        refill(&c->connections, &l->connections, now);
+        refill(&c->auth_failures, &l->auth_failures, now);
+        if (c->connections.tokens >= l->connections.burst &&
+            c->auth_failures.tokens >= l->auth_failures.burst) {
+            *prev = c->next;
+            free(c);
+            shard->items--;
+        } else
+            prev = &c->next;
+    }
+}
+
+/* Finds (creating if needed) the entry for an address, refills its
+ * buckets and returns it with its shard locked. Returns NULL, with
+ * nothing locked, if the address is not tracked. */
+static struct client *client_lookup(const struct sockaddr *addr, const struct limits *l,
+                                    struct shard **locked) {
+    unsigned char key[16];
+    if (address_key(addr, key) < 0)
+        return NULL;
+
+    uint32_t h = key_hash(key);
+    struct shard *shard = &shards[h % SHARDS];
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&shard->lock);
+
+    struct client **head = &shard->buckets[(h / SHARDS) % SHARD_BUCKETS];
+    struct client *c;
+    for (c = *head; c && memcmp(c->addr, key, 16); c = c->next)
+        ;
+    if (!c) {
+        if (shard->items >= SHARD_MAX_ITEMS)
+            shard_sweep(shard, l, now);
+        if (shard->items >= SHARD_MAX_ITEMS || !(c = malloc(sizeof(*c)))) {
+            pthread_mutex_unlock(&shard->lock);
+            return NULL;
+        }
+        memcpy(c->addr, key, 16);
+        c->connections.tokens = l->connections.burst;
+        c->auth_failures.tokens = l->auth_failures.burst;
+        c->connections.updated = c->auth_failures.updated = now;
+        c->next = *head;
+        *head = c;
+        shard->items++;
+    } else {
+        refill(&c->connections, &l->connections, now);
+        refill(&c->auth_failures, &l->auth_failures, now);
+    }
+    *locked = shard;
+    return c;
+}
+
+/** Takes a connection token for a client. A client that has no login
+ *  attempts left is refused as well.
+ *
+ *  Returns: non-zero (true) if the connection may proceed.
+ */
+int ratelimit_allow_connection(const struct sockaddr *addr) {
+    struct limits l;
+    limits_get(&l);
+    if (!l.connections.rate && !l.auth_failures.rate)
+        return 1;
+
+    struct shard *shard;
+    struct client *c = client_lookup(addr, &l, &shard);
+    if (!c)
+        return 1;
+    int allowed = 1;
+    if (l.auth_failures.rate && c->auth_failures.tokens < 1)
+        allowed = 0;
+    else if (l.connections.rate) {
+        if (c->connections.tokens >= 1)
+            c->connections.tokens -= 1;
+        else
+            allowed = 0;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return allowed;
+}
+
+/** Returns non-zero (true) if a client may still try a password.
+ */
+int ratelimit_auth_allowed(const struct sockaddr *addr) {
+    struct limits l;
+    limits_get(&l);
+    if (!l.auth_failures.rate)
+        return 1;
+
+    struct shard *shard;
+    struct client *c = client_lookup(addr, &l, &shard);
+    if (!c)
+        return 1;
+    int allowed = c->auth_failures.tokens >= 1;
+    pthread_mutex_unlock(&shard->lock);
+    return allowed;
+}
+
+/** Records a failed login for a client.
+ */
+void ratelimit_auth_failure(const struct sockaddr *addr) {
+    struct limits l;
+    limits_get(&l);
+    if (!l.auth_failures.rate)
+        return;
+
+    struct shard *shard;
+    struct client *c = client_lookup(addr, &l, &shard);
+    if (!c)
+        return;
+    c->auth_failures.tokens = c->auth_failures.tokens >= 1 ? c->auth_failures.tokens - 1 : 0;
+    pthread_mutex_unlock(&shard->lock);
+}
@@ -0,0 +1,25 @@
+/* ratelimit.h
+ * Per-client-address token buckets, used to refuse clients that open
+ * connections or fail logins faster than their allowance.
+ */
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <sys/socket.h>
+
+/* A bucket holds up to burst tokens and refills at rate tokens per
+ * second. A rate of 0 disables the limit. */
+typedef struct rate_limit {
+    double rate;
+    double burst;
+} rate_limit;
+
+int  ratelimit_parse(const char *spec, rate_limit *limit);
+void ratelimit_configure(const rate_limit *connections, const rate_limit *auth_failures);
+
+int  ratelimit_allow_connection(const struct sockaddr *addr);
+int  ratelimit_auth_allowed(const struct sockaddr *addr);
+void ratelimit_auth_failure(const struct sockaddr *addr);
+
+#endif
@@ -10,8 +10,14 @@
  * Programming (http://beej.us/guide/bgnet/).
  */
 //x
+#define _GNU_SOURCE
 #include "server.h"
 #include "util.h"
+#include "ratelimit.h"
+#include "coro.h"
+#include "handoff.h"
+#include "topology.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,17 +28,40 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <stdatomic.h>
 
 
 /* TODO: Fill in the server code. You are required to listen on all interfaces for connections. For each connection,
  * invoke the handler on a new thread. */
 
+static int listen_fd = -1;
+
+// Worker processes: the master keeps their process ids, and each worker
+// knows its index (-1 in the master, or without workers).
+static pid_t *worker_pids;
+static int worker_index = -1;
+
+// Handing the listening socket over: once draining is set, the accept
+// loop stops, and the process exits when no session is left. The
+// accept loop keeps accepting set while it may be about to start a
+// session, so that the exit cannot come in between.
+static atomic_int draining;
+static atomic_int accepting;
+static atomic_int active_sessions;
+
 struct thread_args {
     int client_socket;
     void (*handler)(void *);
@@ -46,15 +75,194 @@ void *thread_handler(void *arg) {
     pthread_detach(pthread_self());
     handler((void *)&client_socket);
     close(client_socket);
+    atomic_fetch_sub(&active_sessions, 1);
     return NULL;
 }
 
-void run_server(const char *port, void (*handler)(void *)) {
-    // TODO: Implement this function
-    int server_fd, new_socket;
-    struct addrinfo hints, *res, *p;
+/* Runs a session in a coroutine. The handler's reads and writes park
+ * the coroutine instead of the thread. */
+static void coroutine_handler(void *arg) {
+    struct thread_args *args = (struct thread_args *)arg;
+    int client_socket = args->client_socket;
+    void (*handler)(void *) = args->handler;
+    free(arg);
+    handler((void *)&client_socket);
+    close(client_socket);
+    atomic_fetch_sub(&active_sessions, 1);
+}
+
+struct listener {
+    int server_fd;
+    int coroutines;
+    void (*handler)(void *);
+    const server_options *options;
+    pthread_attr_t thread_attr;
+    int pin_cpus;
+    cpu_set_t allowed;          // CPUs session threads may be pinned to
+};
+
+/* Returns the CPU that handled a connection's incoming packets, or -1
+ * if unknown. */
+static int incoming_cpu(int fd) {
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+        return -1;
+    return cpu;
+}
+
+/* Starts a session (a thread or a coroutine) for an accepted
+ * connection, or closes it if the rate limiter refuses it. */
+static void start_session(struct listener *l, int new_socket, struct sockaddr *client_addr) {
+    // Refuse clients over their connection allowance right away,
+    // before a thread is spent on them.
+    if (!ratelimit_allow_connection(client_addr)) {
+        if (l->options && l->options->reject_message)
+            send(new_socket, l->options->reject_message, strlen(l->options->reject_message),
+                 MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(new_socket);
+        return;
+    }
+    // Greet in the same pass as the accept: the send buffer of a new
+    // connection is empty, so this never has to wait, and the client
+    // can send its first command before the session even starts.
+    const char *greeting = l->options ? l->options->greeting : NULL;
+    if (greeting) {
+        ssize_t len = strlen(greeting);
+        if (send(new_socket, greeting, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len) {
+            close(new_socket);
+            return;
+        }
+        metrics_bytes_sent(len);
+    }
+    struct thread_args *args = malloc(sizeof(struct thread_args));
+    if (args == NULL) {
+        close(new_socket);
+        return;
+    }
+    args->client_socket = new_socket;
+    args->handler = l->handler;
+    atomic_fetch_add(&active_sessions, 1);
+    // With pinning, the session runs on the CPU that receives its
+    // packets, next to the socket's memory.
+    int cpu = l->pin_cpus ? incoming_cpu(new_socket) : -1;
+    if (l->coroutines) {
+        if (coro_spawn_on(cpu, coroutine_handler, args) != 0) {
+            close(new_socket);
+            free(args);
+            atomic_fetch_sub(&active_sessions, 1);
+        }
+        return;
+    }
+    if (l->pin_cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &l->allowed))
+            CPU_SET(cpu, &set);
+        else
+            set = l->allowed;
+        pthread_attr_setaffinity_np(&l->thread_attr, sizeof(set), &set);
+    }
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, &l->thread_attr, thread_handler, args) != 0) {
+        close(new_socket);
+        free(args);
+        atomic_fetch_sub(&active_sessions, 1);
+    }
+}
+
+/* Accepts connections until the listening socket is handed over,
+ * starting a session for each. Runs on the main thread, or in a
+ * coroutine of its own so that waiting goes through the coroutine
+ * backend too.
+ *
+ * The listening socket is non-blocking and the loop waits for it to
+ * be readable before each accept, rather than leaving a blocking (or
+ * io_uring) accept pending: a pending accept could still take a
+ * connection after the socket has gone to a successor. */
+static void accept_loop(void *arg) {
+    struct listener *l = arg;
     struct sockaddr_storage client_addr;
     socklen_t addr_size;
+    int batch = l->options && l->options->accept_batch > 0 ? l->options->accept_batch
+                                                           : DEFAULT_ACCEPT_BATCH;
+    int accepted = 0;
+
+    while (1) {
+        addr_size = sizeof client_addr;
+        atomic_store(&accepting, 1);
+        if (atomic_load(&draining)) {
+            atomic_store(&accepting, 0);
+            return;
+        }
+        // Session sockets are non-blocking only for coroutines on
+        // epoll; a session thread blocks in recv() and send(), and so
+        // does the ring for coroutines on io_uring.
+        int new_socket = accept4(l->server_fd, (struct sockaddr *)&client_addr, &addr_size,
+                                 SOCK_CLOEXEC | (l->coroutines ? coro_socket_flags() : 0));
+        if (new_socket >= 0)
+            start_session(l, new_socket, (struct sockaddr *)&client_addr);
+        atomic_store(&accepting, 0);
+        // The queue is drained without waiting in between; a
+        // coroutine acceptor lets the sessions on its worker run
+        // every batch connections, so that a storm does not starve
+        // them.
+        if (new_socket >= 0) {
+            if (++accepted % batch == 0)
+                coro_yield();
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            coro_wait_fd(l->server_fd, POLLIN);
+        }
+    }
+}
+
+/* Waits for a successor on the handoff socket, gives it the listening
+ * socket, and exits once the sessions still running here have ended.
+ * Runs on a thread of its own. */
+static void *handoff_thread(void *arg) {
+    int handoff_fd = (int)(intptr_t) arg;
+    while (handoff_send(handoff_fd, listen_fd) < 0)
+        perror("handoff");
+    close(handoff_fd);
+    atomic_store(&draining, 1);
+
+    int sessions = atomic_load(&active_sessions);
+    printf("Listening socket handed over, draining %d sessions...\n", sessions);
+    fflush(stdout);
+    while (atomic_load(&accepting) || atomic_load(&active_sessions) > 0)
+        usleep(10000);
+    printf("Sessions drained, exiting\n");
+    exit(0);
+}
+
+/** Changes the backlog of the listening socket while the server runs
+ *  (calling listen() again on a listening socket only updates it).
+ */
+void server_set_backlog(int backlog) {
+    if (listen_fd >= 0 && listen(listen_fd, backlog > 0 ? backlog : DEFAULT_BACKLOG) == -1)
+        perror("listen");
+}
+
+/* Applies the socket options of the listening socket, whether it was
+ * just bound or taken over from a previous server. */
+static void apply_socket_profile(int server_fd, const server_options *options) {
+    if (listen(server_fd, options && options->backlog > 0 ? options->backlog : DEFAULT_BACKLOG) == -1) {
+        perror("listen");
+        exit(1);
+    }
+    // TCP_DEFER_ACCEPT is deliberately not set: a POP3 client waits
+    // for the greeting, so deferring the accept until the client sends
+    // data would only stall every session until the timeout.
+    int fastopen = options ? options->fastopen : 0;
+    if (fastopen > 0 &&
+        setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen)) == -1)
+        perror("TCP_FASTOPEN");
+}
+
+/* Creates the listening socket. */
+static int bind_server(const char *port, const server_options *options) {
+    int server_fd;
+    struct addrinfo hints, *res, *p;
     int yes = 1;
 
     memset(&hints, 0, sizeof hints);
@@ -62,12 +270,14 @@ void run_server(const char *port, void (*handler)(void *)) {
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
-    if (getaddrinfo(NULL, port, &hints, &res) != 0) exit(1);
+    if (getaddrinfo(options && options->address ? options->address : NULL, port, &hints, &res) != 0) exit(1);
 
     for (p = res; p != NULL; p = p->ai_next) {
-        server_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        server_fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
         if (server_fd == -1) continue;
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+            (options && options->workers > 0 &&
+             setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)) {
             perror("setsockopt");
             close(server_fd);
             exit(1);
@@ -85,26 +295,178 @@ void run_server(const char *port, void (*handler)(void *)) {
         fprintf(stderr, "server: failed to bind\n");
         exit(1);
     }
+    return server_fd;
+}
 
-    if (listen(server_fd, 10) == -1) exit(1);
+/** Sends a signal to every worker process (does nothing without
+ *  workers).
+ */
+void server_signal_workers(int sig) {
+    if (worker_index >= 0 || !worker_pids)
+        return;
+    for (int i = 0; worker_pids[i] >= 0; i++)
+        if (worker_pids[i] > 0)
+            kill(worker_pids[i], sig);
+}
+
+/* Forks a worker process. Returns 0 in the worker, its process id in
+ * the master, or -1 on error. */
+static pid_t spawn_worker(int index, int reserve_fd, const server_options *options) {
+    pid_t master = getpid();
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    // A worker must not outlive the master, which may have died
+    // before this could be set.
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != master)
+        exit(0);
+    close(reserve_fd);
+    worker_index = index;
+    metrics_worker_start(index);
+    if (options->process_start)
+        options->process_start(index);
+    return 0;
+}
+
+/* Starts the worker processes and, in the master, restarts any that
+ * exits, forever. Returns only in a worker, which goes on to accept
+ * connections as a server of its own.
+ *
+ * The master binds a socket to the port without listening on it: this
+ * checks the port is free, and keeps it reserved for the workers while
+ * they restart. A socket that does not listen gets no connections. */
+static void run_prefork(const char *port, const server_options *options) {
+    int count = options->workers;
+    int reserve_fd = bind_server(port, options);
+    if (metrics_share(count) < 0) {
+        perror("shared memory");
+        exit(1);
+    }
+    // Terminated by -1, for server_signal_workers().
+    worker_pids = calloc(count + 1, sizeof(pid_t));
+    time_t *started = calloc(count, sizeof(time_t));
+    worker_pids[count] = -1;
+    for (int i = 0; i < count; i++) {
+        pid_t pid = spawn_worker(i, reserve_fd, options);
+        if (pid == 0)
+            return;
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        worker_pids[i] = pid;
+        started[i] = time(NULL);
+    }
 
-    printf("Server is listening on port %s...\n", port);
+    printf("Server is listening on port %s with %d worker processes...\n", port, count);
+    fflush(stdout);
+    if (options->process_start)
+        options->process_start(-1);
 
     while (1) {
-        addr_size = sizeof client_addr;
-        new_socket = accept(server_fd, (struct sockaddr *)&client_addr, &addr_size);
-        if (new_socket == -1) continue;
-        struct thread_args *args = malloc(sizeof(struct thread_args));
-        if (args == NULL) continue;
-        args->client_socket = new_socket;
-        args->handler = handler;
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, thread_handler, args) != 0) {
-            close(new_socket);
-            free(args);
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno != EINTR)
+                perror("waitpid");
             continue;
         }
+        int i;
+        for (i = 0; i < count && worker_pids[i] != pid; i++)
+            ;
+        if (i == count)
+            continue;
+        if (WIFSIGNALED(status))
+            fprintf(stderr, "Worker %d (process %d) killed by signal %d, restarting\n",
+                    i, (int) pid, WTERMSIG(status));
+        else
+            fprintf(stderr, "Worker %d (process %d) exited with status %d, restarting\n",
+                    i, (int) pid, WEXITSTATUS(status));
+        worker_pids[i] = 0;
+        metrics_worker_exited(i);
+        // A worker that fails right away would otherwise be restarted
+        // in a tight loop.
+        if (time(NULL) - started[i] < 1)
+            sleep(1);
+        while ((pid = spawn_worker(i, reserve_fd, options)) < 0) {
+            perror("fork");
+            sleep(1);
+        }
+        if (pid == 0)
+            return;
+        worker_pids[i] = pid;
+        started[i] = time(NULL);
+    }
+}
+
+void run_server(const char *port, void (*handler)(void *), const server_options *options) {
+    // TODO: Implement this function
+    if (options && options->workers > 0)
+        run_prefork(port, options);
+    const char *handoff_socket = options ? options->handoff_socket : NULL;
+    int server_fd = handoff_socket ? handoff_receive(handoff_socket) : -1;
+    if (server_fd >= 0)
+        printf("Took over the listening socket of the running server\n");
+    else
+        server_fd = bind_server(port, options);
+    apply_socket_profile(server_fd, options);
+    listen_fd = server_fd;
+    // The accept loop waits for the socket to be readable, and never
+    // blocks in accept() (see accept_loop()).
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+    int coroutines = options && options->coroutine_threads > 0;
+    int pin_cpus = options && options->pin_cpus;
+    if (coroutines &&
+        coro_runtime_start(options->coroutine_threads,
+                           options->coroutine_stack ? options->coroutine_stack : CORO_DEFAULT_STACK_SIZE,
+                           (options->io_uring ? CORO_IO_URING : 0) |
+                           (pin_cpus ? CORO_PIN_CPUS : 0)) < 0) {
+        perror("coroutine runtime");
+        exit(1);
+    }
+
+    if (handoff_socket) {
+        int handoff_fd = handoff_listen(handoff_socket);
+        pthread_t thread;
+        if (handoff_fd < 0) {
+            perror(handoff_socket);
+            exit(1);
+        }
+        pthread_create(&thread, NULL, handoff_thread, (void *)(intptr_t) handoff_fd);
+        pthread_detach(thread);
+    }
+
+    if (worker_index < 0) {
+        printf("Server is listening on port %s...\n", port);
+        fflush(stdout);
+    }
+
+    struct listener listener = { server_fd, coroutines, handler, options };
+    listener.pin_cpus = pin_cpus;
+    if (pin_cpus && !coroutines) {
+        // The acceptor takes the first CPU, and each session the CPU
+        // its connection arrives on.
+        sched_getaffinity(0, sizeof(listener.allowed), &listener.allowed);
+        topo_pin_thread(topo_cpu(0));
+    }
+    if (!coroutines) {
+        // Sessions need little stack; the default (often 8 MB) mostly
+        // wastes address space and the memory of cached stacks.
+        pthread_attr_init(&listener.thread_attr);
+        pthread_attr_setstacksize(&listener.thread_attr,
+                                  options && options->thread_stack ? options->thread_stack
+                                                                   : DEFAULT_THREAD_STACK_SIZE);
+        accept_loop(&listener);
+    } else if (coro_spawn(accept_loop, &listener) != 0) {
+        perror("coroutine");
+        exit(1);
     }
+    // After a handoff, the handoff thread ends the process.
+    while (1)
+        pause();
     close(server_fd); 
 }
 
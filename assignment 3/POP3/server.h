@@ -12,6 +12,56 @@
 
 #include <stdio.h>
 
-void        run_server(const char *port, void (*handler)(void *));
+#define DEFAULT_THREAD_STACK_SIZE (128 * 1024)
+#define DEFAULT_BACKLOG           1024
+#define DEFAULT_ACCEPT_BATCH      16
+
+typedef struct server_options {
+    // Address to listen on, or NULL for all interfaces
+    const char *address;
+    // Length of the queue of connections waiting to be accepted (0 for
+    // DEFAULT_BACKLOG)
+    int backlog;
+    // Sent to clients refused by the rate limiter before closing
+    const char *reject_message;
+    // Stack size of session threads, in bytes (0 for
+    // DEFAULT_THREAD_STACK_SIZE)
+    size_t thread_stack;
+    // Number of threads running sessions as coroutines; 0 runs each
+    // session on a thread of its own
+    int coroutine_threads;
+    // Stack size of each coroutine session, in bytes
+    size_t coroutine_stack;
+    // Coroutine sessions perform socket and file I/O through io_uring
+    int io_uring;
+    // Unix socket path through which a successor takes over the
+    // listening socket (and this server's one is taken over, if a
+    // server listens on it at startup), or NULL
+    const char *handoff_socket;
+    // Pin threads to CPUs, run each session on the CPU its connection
+    // arrives on, and keep session memory on that CPU's NUMA node
+    int pin_cpus;
+    // Queue length for TCP Fast Open on the listening socket, or 0 to
+    // leave it off
+    int fastopen;
+    // Connections a coroutine acceptor takes in a row before letting
+    // the sessions of its worker run (0 for DEFAULT_ACCEPT_BATCH)
+    int accept_batch;
+    // Sent as soon as a connection is accepted, before the session
+    // starts, or NULL to leave the greeting to the handler
+    const char *greeting;
+    // Number of worker processes, each accepting connections on a
+    // listening socket of its own (SO_REUSEPORT) and running sessions
+    // as set above; 0 serves everything in this process. Cannot be
+    // combined with handoff_socket.
+    int workers;
+    // Called in each worker process as it starts, with its index, and
+    // in the master once the first workers run, with -1; or NULL
+    void (*process_start)(int worker);
+} server_options;
+
+void        run_server(const char *port, void (*handler)(void *), const server_options *options);
+void        server_set_backlog(int backlog);
+void        server_signal_workers(int sig);
 
 #endif
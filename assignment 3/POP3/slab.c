@@ -0,0 +1,108 @@
+/* slab.c
+ * Fixed-size object allocator.
+ *
+ * Slabs are mmap'd in one piece and never returned to the system; the
+ * cache only ever grows to the largest number of objects alive at
+ * once. Free objects are kept on a list linked through their first
+ * word. A lock protects the list, which is held only for a couple of
+ * pointer updates per call.
+ *
+ * On a NUMA machine, each node has a list of its own, filled from
+ * slabs placed on that node: a thread gets objects from the memory of
+ * the node it runs on. A freed object goes back to the list of the
+ * node its slab is on, whichever thread frees it, so that no list
+ * hands out remote memory; the node is kept in a small header in front
+ * of each object.
+ */
+
+#include "slab.h"
+#include "topology.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* Bytes in front of each object, holding the node of its slab (16 so
+ * that objects stay aligned) */
+#define SLAB_HEADER 16
+
+struct slab_node {
+    pthread_mutex_t lock;
+    void *free_list;
+} __attribute__ ((aligned(64)));
+
+struct slab_cache {
+    size_t slot_size;           // Object and header
+    size_t objects_per_slab;
+    int node_count;
+    struct slab_node nodes[];
+};
+
+/** Creates a cache of objects of the given size (rounded up to a
+ *  multiple of 16 bytes, so objects stay suitably aligned).
+ *
+ *  Returns: the cache, or NULL if out of memory.
+ */
+slab_cache *slab_create(size_t object_size, size_t objects_per_slab) {
+    int nodes = topo_node_count();
+    slab_cache *cache = aligned_alloc(64, sizeof(*cache) + nodes * sizeof(struct slab_node));
+    if (!cache)
+        return NULL;
+    cache->slot_size = ((object_size + 15) & ~(size_t) 15) + SLAB_HEADER;
+    cache->objects_per_slab = objects_per_slab ? objects_per_slab : 1;
+    cache->node_count = nodes;
+    for (int i = 0; i < nodes; i++) {
+        pthread_mutex_init(&cache->nodes[i].lock, NULL);
+        cache->nodes[i].free_list = NULL;
+    }
+    return cache;
+}
+
+/* Adds a new slab, placed on the given node, to the node's free list.
+ * Called with the node's list locked. */
+static int slab_grow(slab_cache *cache, int node) {
+    struct slab_node *n = &cache->nodes[node];
+    size_t size = cache->slot_size * cache->objects_per_slab;
+    char *slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED)
+        return -1;
+    topo_prefer_node(slab, size, node);
+    for (size_t i = cache->objects_per_slab; i-- > 0; ) {
+        char *slot = slab + i * cache->slot_size;
+        void *object = slot + SLAB_HEADER;
+        *(int *) slot = node;
+        *(void **) object = n->free_list;
+        n->free_list = object;
+    }
+    return 0;
+}
+
+static int current_node(const slab_cache *cache) {
+    return cache->node_count > 1 ? topo_current_node() % cache->node_count : 0;
+}
+
+/** Returns an uninitialized object, or NULL if out of memory.
+ */
+void *slab_alloc(slab_cache *cache) {
+    int node = current_node(cache);
+    struct slab_node *n = &cache->nodes[node];
+    pthread_mutex_lock(&n->lock);
+    if (!n->free_list && slab_grow(cache, node) < 0) {
+        pthread_mutex_unlock(&n->lock);
+        return NULL;
+    }
+    void *object = n->free_list;
+    n->free_list = *(void **) object;
+    pthread_mutex_unlock(&n->lock);
+    return object;
+}
+
+void slab_free(slab_cache *cache, void *object) {
+    if (!object)
+        return;
+    struct slab_node *n = &cache->nodes[*(int *) ((char *) object - SLAB_HEADER)];
+    pthread_mutex_lock(&n->lock);
+    *(void **) object = n->free_list;
+    n->free_list = object;
+    pthread_mutex_unlock(&n->lock);
+}
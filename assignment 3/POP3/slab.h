@@ -0,0 +1,18 @@
+/* slab.h
+ * Fixed-size object allocator. Objects are carved out of large slabs
+ * and recycled through a free list, so allocating one costs neither a
+ * malloc header nor a trip into the general-purpose allocator.
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+
+typedef struct slab_cache slab_cache;
+
+slab_cache *slab_create(size_t object_size, size_t objects_per_slab);
+void       *slab_alloc(slab_cache *cache);
+void        slab_free(slab_cache *cache, void *object);
+
+#endif
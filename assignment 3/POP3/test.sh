@@ -28,6 +28,9 @@ for i in $pattern ; do
     ./mypopd $port >& $logfile &
     sleep 1
     nc localhost $port -w 3 < $i > $outfile
+    # UIDL ids start with the inode of the message file, which changes
+    # with every copy of the mail store.
+    sed -i -E 's/^(\+OK )?([0-9]+) [0-9a-f]+\./\1\2 INODE./' $outfile
     sleep 1
     pkill mypopd
     if diff -c $expfile $outfile ; then
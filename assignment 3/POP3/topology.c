@@ -0,0 +1,124 @@
+/* topology.c
+ * CPU and NUMA node topology.
+ *
+ * The allowed CPUs come from the affinity mask the process was
+ * started with (so taskset or a cgroup still decides which CPUs the
+ * server may use), and the node of each CPU from sysfs. Memory is
+ * steered to a node with mbind(), called directly so that libnuma is
+ * not needed. On a machine with a single node, everything reports
+ * node 0 and memory placement does nothing.
+ */
+
+#define _GNU_SOURCE
+#include "topology.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+static int cpus[CPU_SETSIZE];           // Allowed CPUs, in increasing order
+static int cpu_count;
+static signed char cpu_node[CPU_SETSIZE];
+static int node_count = 1;
+static pthread_once_t topo_once = PTHREAD_ONCE_INIT;
+
+/* Reads the node of a CPU from the nodeN entry of its sysfs
+ * directory. */
+static int read_cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+    struct dirent *entry;
+    int node = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node < TOPO_MAX_NODES ? node : 0;
+}
+
+static void topo_init(void) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        cpus[cpu_count++] = 0;
+        return;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[cpu_count++] = cpu;
+            cpu_node[cpu] = read_cpu_node(cpu);
+            if (cpu_node[cpu] + 1 > node_count)
+                node_count = cpu_node[cpu] + 1;
+        }
+    }
+}
+
+/** Returns the number of CPUs the process may run on.
+ */
+int topo_cpu_count(void) {
+    pthread_once(&topo_once, topo_init);
+    return cpu_count;
+}
+
+/** Returns the index-th allowed CPU (wrapping around past the last).
+ */
+int topo_cpu(int index) {
+    pthread_once(&topo_once, topo_init);
+    return cpus[index % cpu_count];
+}
+
+/** Returns the number of NUMA nodes (one more than the highest node
+ *  of an allowed CPU).
+ */
+int topo_node_count(void) {
+    pthread_once(&topo_once, topo_init);
+    return node_count;
+}
+
+/** Returns the NUMA node of a CPU, or 0 if it is unknown.
+ */
+int topo_node_of_cpu(int cpu) {
+    pthread_once(&topo_once, topo_init);
+    return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_node[cpu] : 0;
+}
+
+/** Returns the NUMA node of the CPU the caller is running on.
+ */
+int topo_current_node(void) {
+    if (topo_node_count() == 1)
+        return 0;
+    return topo_node_of_cpu(sched_getcpu());
+}
+
+/** Restricts the calling thread to a single CPU.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int topo_pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+/** Asks for the pages of a range not yet touched to be allocated on a
+ *  node (falling back to other nodes when it is full). Call before
+ *  the memory is first written.
+ */
+void topo_prefer_node(void *addr, size_t len, int node) {
+    if (topo_node_count() == 1 || node < 0 || node >= TOPO_MAX_NODES)
+        return;
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, TOPO_MAX_NODES + 1, 0);
+}
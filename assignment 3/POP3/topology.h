@@ -0,0 +1,21 @@
+/* topology.h
+ * CPUs the process may run on and the NUMA nodes they belong to, for
+ * placing threads and their memory on the same node.
+ */
+
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include <stddef.h>
+
+#define TOPO_MAX_NODES 64
+
+int  topo_cpu_count(void);
+int  topo_cpu(int index);
+int  topo_node_count(void);
+int  topo_node_of_cpu(int cpu);
+int  topo_current_node(void);
+int  topo_pin_thread(int cpu);
+void topo_prefer_node(void *addr, size_t len, int node);
+
+#endif
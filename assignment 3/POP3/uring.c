@@ -0,0 +1,150 @@
+/* uring.c
+ * A minimal io_uring ring, set up and driven with the raw system
+ * calls. Only what the coroutine runtime needs: hand out submission
+ * entries, submit them all with a single io_uring_enter (optionally
+ * waiting for completions), and walk the completion queue.
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/** Creates a ring with room for the given number of submissions.
+ *
+ *  Returns: 0 on success, -1 on error (e.g., ENOSYS, or EPERM where
+ *           io_uring is disabled).
+ */
+int uring_init(uring *ring, unsigned int entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0)
+        return -1;
+    ring->entries = p.sq_entries;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // Submission entries are always used in order, so the indirection
+    // array is set up once as the identity.
+    unsigned int *array = (unsigned int *) (sq + p.sq_off.array);
+    for (unsigned int i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+
+fail:
+    uring_destroy(ring);
+    return -1;
+}
+
+void uring_destroy(uring *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/** Returns a cleared submission entry, or NULL if the submission
+ *  queue is full (call uring_submit() to make room). The entry is
+ *  only seen by the kernel at the next uring_submit().
+ */
+struct io_uring_sqe *uring_get_sqe(uring *ring) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->entries)
+        return NULL;
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/** Submits all pending entries and waits until at least wait_nr
+ *  completions are available.
+ *
+ *  Returns: number of entries submitted, or -1 on error.
+ */
+int uring_submit(uring *ring, unsigned int wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned int pending = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (!pending && !wait_nr)
+        return 0;
+    int rv;
+    do {
+        rv = sys_io_uring_enter(ring->fd, pending, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (rv < 0 && errno == EINTR);
+    return rv;
+}
+
+/** Returns the oldest unprocessed completion, or NULL if there is
+ *  none. Call uring_cqe_seen() once it has been handled.
+ */
+struct io_uring_cqe *uring_peek_cqe(uring *ring) {
+    unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/** Registers buffers for IORING_OP_READ_FIXED/WRITE_FIXED; buffer i
+ *  is then used with buf_index i.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int uring_register_buffers(uring *ring, const struct iovec *iov, unsigned int count) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) < 0 ? -1 : 0;
+}
@@ -0,0 +1,33 @@
+/* uring.h
+ * A minimal io_uring ring, set up and driven with the raw system
+ * calls (no liburing). Not thread-safe: each ring belongs to one
+ * thread.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+typedef struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask;
+    unsigned int sqe_tail;      // Entries handed out, not all submitted yet
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+} uring;
+
+int                  uring_init(uring *ring, unsigned int entries);
+void                 uring_destroy(uring *ring);
+struct io_uring_sqe *uring_get_sqe(uring *ring);
+int                  uring_submit(uring *ring, unsigned int wait_nr);
+struct io_uring_cqe *uring_peek_cqe(uring *ring);
+void                 uring_cqe_seen(uring *ring);
+int                  uring_register_buffers(uring *ring, const struct iovec *iov, unsigned int count);
+
+#endif
@@ -0,0 +1,181 @@
+/* userdb.c
+ * In-memory index of the users file.
+ *
+ * The file is parsed into an immutable hash table, built without any
+ * lock held, and then published by swapping a single pointer. Lookups
+ * hold a read lock only while they search the current table, and the
+ * swap holds the write lock only for the pointer assignment, so a
+ * reload never makes a login wait for the file to be read, and a
+ * login never sees a half-built table. The old table is freed once
+ * the swap returns, as no lookup can still be using it.
+ */
+
+#include "userdb.h"
+#include "mailuser.h"
+#include "mailstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+struct user_entry {
+    unsigned int hash;
+    char *username;
+    char *password;
+};
+
+struct user_index {
+    size_t mask;                // Number of slots - 1 (a power of two)
+    struct user_entry *slots;   // Open addressing; empty slots have no username
+    char *strings;              // Storage of all names and passwords
+};
+
+static struct user_index *current;
+static pthread_rwlock_t current_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void index_free(struct user_index *index) {
+    if (index) {
+        free(index->slots);
+        free(index->strings);
+        free(index);
+    }
+}
+
+/* Returns the slot holding username, or the empty slot where it would
+ * be inserted. */
+static struct user_entry *index_find(const struct user_index *index, const char *username,
+                                     unsigned int hash) {
+    for (size_t i = hash & index->mask; ; i = (i + 1) & index->mask) {
+        struct user_entry *e = &index->slots[i];
+        if (!e->username || (e->hash == hash && !strcasecmp(e->username, username)))
+            return e;
+    }
+}
+
+/* Reads a users file into a new index. Returns NULL if the file
+ * cannot be read. */
+static struct user_index *index_build(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return NULL;
+
+    // Names and passwords are copied into one growing string buffer;
+    // entries record offsets until the buffer stops moving.
+    size_t count = 0, capacity = 64, used = 0, size = 4096;
+    size_t (*offsets)[2] = malloc(capacity * sizeof(*offsets));
+    char *strings = malloc(size);
+    char user[MAX_USERNAME_SIZE + 1], password[MAX_PASSWORD_SIZE + 1];
+    while (fscanf(file, "%255s%255s", user, password) == 2) {
+        size_t ulen = strlen(user) + 1, plen = strlen(password) + 1;
+        if (count == capacity) {
+            capacity *= 2;
+            offsets = realloc(offsets, capacity * sizeof(*offsets));
+        }
+        while (used + ulen + plen > size) {
+            size *= 2;
+            strings = realloc(strings, size);
+        }
+        offsets[count][0] = used;
+        memcpy(strings + used, user, ulen);
+        used += ulen;
+        offsets[count][1] = used;
+        memcpy(strings + used, password, plen);
+        used += plen;
+        count++;
+    }
+    fclose(file);
+
+    struct user_index *index = malloc(sizeof(*index));
+    size_t slots = 16;
+    while (slots < 2 * count)
+        slots *= 2;
+    index->mask = slots - 1;
+    index->slots = calloc(slots, sizeof(struct user_entry));
+    index->strings = strings;
+    for (size_t i = 0; i < count; i++) {
+        char *name = strings + offsets[i][0];
+        unsigned int hash = mail_hash(name);
+        struct user_entry *e = index_find(index, name, hash);
+        // As with a linear scan of the file, the first entry for a
+        // name wins.
+        if (!e->username) {
+            e->hash = hash;
+            e->username = name;
+            e->password = strings + offsets[i][1];
+        }
+    }
+    free(offsets);
+    return index;
+}
+
+/** Reads a users file and makes it the one used by userdb_check().
+ *  Lookups running meanwhile keep using the previous contents.
+ *
+ *  Parameters: path: Users file to read.
+ *
+ *  Returns: 0 on success, -1 if the file cannot be read (the previous
+ *           contents then remain in use).
+ */
+int userdb_load(const char *path) {
+    struct user_index *index = index_build(path);
+    if (!index)
+        return -1;
+
+    pthread_rwlock_wrlock(&current_lock);
+    struct user_index *old = current;
+    current = index;
+    pthread_rwlock_unlock(&current_lock);
+    index_free(old);
+    return 0;
+}
+
+static void default_load(void) {
+    if (!current)
+        userdb_load(USER_FILE_NAME);
+}
+
+/** Checks a user name and, unless password is NULL, its password
+ *  (see is_valid_user). Loads USER_FILE_NAME on first use if no file
+ *  has been loaded yet.
+ *
+ *  Returns: non-zero (true) if the user exists (and the password
+ *           matches), zero otherwise.
+ */
+int userdb_check(const char *username, const char *password) {
+    pthread_once(&default_once, default_load);
+
+    unsigned int hash = mail_hash(username);
+    int valid = 0;
+    pthread_rwlock_rdlock(&current_lock);
+    if (current) {
+        struct user_entry *e = index_find(current, username, hash);
+        valid = e->username && (password == NULL || !strcmp(password, e->password));
+    }
+    pthread_rwlock_unlock(&current_lock);
+    return valid;
+}
+
+/** Calls fn for every user of the current users file, holding off
+ *  reloads meanwhile (so fn should be quick).
+ *
+ *  Returns: Number of users.
+ */
+int userdb_foreach(void (*fn)(const char *username, void *arg), void *arg) {
+    pthread_once(&default_once, default_load);
+
+    int count = 0;
+    pthread_rwlock_rdlock(&current_lock);
+    if (current) {
+        for (size_t i = 0; i <= current->mask; i++) {
+            if (current->slots[i].username) {
+                fn(current->slots[i].username, arg);
+                count++;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&current_lock);
+    return count;
+}
@@ -0,0 +1,15 @@
+/* userdb.h
+ * In-memory index of the users file (one "username password" pair per
+ * line), replaced as a whole when the file is reloaded.
+ */
+
+#ifndef _USERDB_H_
+#define _USERDB_H_
+
+#define USER_FILE_NAME "users.txt"
+
+int userdb_load(const char *path);
+int userdb_check(const char *username, const char *password);
+int userdb_foreach(void (*fn)(const char *username, void *arg), void *arg);
+
+#endif
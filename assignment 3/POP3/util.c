@@ -1,4 +1,7 @@
 #include "util.h"
+#include "metrics.h"
+#include "coro.h"
+#include "capture.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -30,19 +33,25 @@ char *trim_angle_brackets(char *name) {
  *
  *  Parameters: line:   The line of text to split
  *                      The characters in the line will be modified by the call.
- *              parts:  An array of char * pointers that will receive the
- *                      pointers to the individual parts of the input line. 
- *                      This array must be long enough to hold all of the
- *                      parts of the line.
+ *              parts:  An array of max_parts char * pointers that will
+ *                      receive pointers to the first max_parts - 1 parts
+ *                      of the input line, followed by NULL.
+ *              max_parts: Number of entries in parts (at least 1).
+ *
+ *  Returns: The number of parts in the line, which may be more than
+ *           were stored.
  **/
-int split(char *buf, char *parts[]) {
-    static char *spaces = " \t\r\n";
-    int i = 1;
-    parts[0] = strtok(buf, spaces);
-    do {
-        parts[i] = strtok(NULL, spaces);
-    } while (parts[i++] != NULL);
-    return i - 1;
+int split(char *buf, char *parts[], int max_parts) {
+    static const char *spaces = " \t\r\n";
+    char *saveptr;
+    int n = 0;
+    for (char *part = strtok_r(buf, spaces, &saveptr); part; part = strtok_r(NULL, spaces, &saveptr)) {
+        if (n < max_parts - 1)
+            parts[n] = part;
+        n++;
+    }
+    parts[n < max_parts - 1 ? n : max_parts - 1] = NULL;
+    return n;
 }
 
 int be_verbose = 1;
@@ -99,15 +108,17 @@ int send_formatted(int fd, const char *fmt, ...) {
 
 int send_all(int fd, char buf[], size_t size) {
 
+    capture_sent(fd, buf, size);
     size_t rem = size;
     while (rem > 0) {
-        int rv = send(fd, buf, rem, MSG_NOSIGNAL);
+        int rv = coro_send(fd, buf, rem, MSG_NOSIGNAL);
         // If there was an error, interrupt sending and returns an error
         if (rv <= 0)
             return rv;
         buf += rv;
         rem -= rv;
     }
+    metrics_bytes_sent(size);
     return size;
 }
 
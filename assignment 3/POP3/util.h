@@ -22,12 +22,15 @@ extern char *trim_angle_brackets(char *name);
  *
  *  Parameters: line:   The line of text to split
  *                      The characters in the line will be modified by the call.
- *              parts:  An array of char * pointers that will receive the
- *                      pointers to the individual parts of the input line. 
- *                      This array must be long enough to hold all of the
- *                      parts of the line.
+ *              parts:  An array of max_parts char * pointers that will
+ *                      receive pointers to the first max_parts - 1 parts
+ *                      of the input line, followed by NULL.
+ *              max_parts: Number of entries in parts (at least 1).
+ *
+ *  Returns: The number of parts in the line, which may be more than
+ *           were stored.
  **/
-extern int   split(char *buf, char *parts[]);
+extern int   split(char *buf, char *parts[], int max_parts);
 
 extern int   be_verbose;
 /**
@@ -0,0 +1,268 @@
+/*
+ * Congestion control algorithms for the STCP sender: Reno, CUBIC and a
+ * simplified model-based algorithm in the style of BBR.
+ *
+ * Windows are kept in bytes; CUBIC works out its curve in segments.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "stcp.h"
+#include "congestion.h"
+
+#define MSS ((int)STCP_MSS)
+#define INITIAL_WINDOW (4 * MSS)
+
+static unsigned long noPacing(congestion_control *cc) {
+    return 0;
+}
+
+static unsigned int currentWindow(congestion_control *cc) {
+    return cc->cwnd;
+}
+
+/* Halved window after a loss, but no less than two segments */
+static unsigned int halvedWindow(unsigned int in_flight) {
+    return max(in_flight / 2, 2 * MSS);
+}
+
+/*
+ * Reno: slow start up to ssthresh, then about a segment more per round
+ * trip; a loss halves the window, a timeout drops it to one segment.
+ */
+
+static void renoInit(congestion_control *cc) {
+    cc->cwnd = INITIAL_WINDOW;
+    cc->ssthresh = STCP_MAXWIN;
+}
+
+static void renoOnAck(congestion_control *cc, const ack_sample *sample) {
+    if (sample->in_recovery)
+        return;
+    if (cc->cwnd < cc->ssthresh)
+        cc->cwnd += min(sample->acked, MSS);
+    else
+        cc->cwnd += max(MSS * MSS / cc->cwnd, 1);
+    cc->cwnd = min(cc->cwnd, STCP_MAXWIN);
+}
+
+static void renoOnLoss(congestion_control *cc, unsigned int in_flight, unsigned long long now) {
+    cc->ssthresh = halvedWindow(in_flight);
+    cc->cwnd = cc->ssthresh;
+}
+
+static void renoOnRto(congestion_control *cc, unsigned int in_flight, unsigned long long now) {
+    cc->ssthresh = halvedWindow(in_flight);
+    cc->cwnd = MSS;
+}
+
+const congestion_ops reno_ops = {
+    "reno", renoInit, renoOnAck, renoOnLoss, renoOnRto, noPacing, currentWindow
+};
+
+/*
+ * CUBIC (RFC 8312): after a loss the window follows a cubic curve of
+ * the time since, flattening out at the window where the loss happened
+ * and probing beyond it after that. It never grows slower than Reno
+ * would.
+ */
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+static void cubicInit(congestion_control *cc) {
+    renoInit(cc);
+    memset(&cc->u.cubic, 0, sizeof(cc->u.cubic));
+}
+
+static void cubicOnAck(congestion_control *cc, const ack_sample *sample) {
+    if (sample->in_recovery)
+        return;
+    if (cc->cwnd < cc->ssthresh) {
+        renoOnAck(cc, sample);
+        return;
+    }
+
+    double w = (double)cc->cwnd / MSS;
+    if (cc->u.cubic.epoch_start == 0) {
+        cc->u.cubic.epoch_start = sample->now;
+        if (cc->u.cubic.w_max > w) {
+            cc->u.cubic.k = cbrt((cc->u.cubic.w_max - w) / CUBIC_C);
+        } else {
+            cc->u.cubic.k = 0;
+            cc->u.cubic.w_max = w;
+        }
+        cc->u.cubic.w_est = w;
+    }
+
+    double t = (sample->now - cc->u.cubic.epoch_start) / 1e6;
+    double target = cc->u.cubic.w_max + CUBIC_C * pow(t - cc->u.cubic.k, 3);
+    cc->u.cubic.w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * sample->acked / MSS / w;
+    if (target < cc->u.cubic.w_est)
+        target = cc->u.cubic.w_est;
+    if (target > 1.5 * w)
+        target = 1.5 * w;
+
+    if (target > w)
+        cc->cwnd += (unsigned int)((target - w) / w * sample->acked);
+    cc->cwnd = min(cc->cwnd, STCP_MAXWIN);
+}
+
+/* Remembers where the loss happened; with fast convergence a window
+ * that is still below the previous one is taken to be a fair share
+ * shrinking, and released further. */
+static void cubicReduce(congestion_control *cc) {
+    double w = (double)cc->cwnd / MSS;
+    if (w < cc->u.cubic.w_max)
+        cc->u.cubic.w_max = w * (1 + CUBIC_BETA) / 2;
+    else
+        cc->u.cubic.w_max = w;
+    cc->u.cubic.epoch_start = 0;
+    cc->ssthresh = max(cc->cwnd * CUBIC_BETA, 2 * MSS);
+}
+
+static void cubicOnLoss(congestion_control *cc, unsigned int in_flight, unsigned long long now) {
+    cubicReduce(cc);
+    cc->cwnd = cc->ssthresh;
+}
+
+static void cubicOnRto(congestion_control *cc, unsigned int in_flight, unsigned long long now) {
+    cubicReduce(cc);
+    cc->cwnd = MSS;
+}
+
+const congestion_ops cubic_ops = {
+    "cubic", cubicInit, cubicOnAck, cubicOnLoss, cubicOnRto, noPacing, currentWindow
+};
+
+/*
+ * A simplified BBR: rather than reacting to losses, it estimates the
+ * bottleneck bandwidth (the highest delivery rate of the last ten
+ * rounds) and the minimum round-trip time, paces at about that
+ * bandwidth, and keeps twice their product in flight. Startup doubles
+ * the rate every round until the bandwidth stops growing, drain then
+ * empties the queue this built, and from then on a cycle of eight
+ * rounds probes for more bandwidth in one and drains in the next.
+ */
+
+#define BBR_STARTUP 0
+#define BBR_DRAIN 1
+#define BBR_PROBE_BW 2
+
+#define BBR_HIGH_GAIN 2.885     /* 2/ln(2) */
+#define BBR_CWND_GAIN 2.0
+#define BBR_MIN_RTT_WINDOW 10000000ULL  /* us */
+
+static const double bbr_cycle_gains[8] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+static void bbrInit(congestion_control *cc) {
+    renoInit(cc);
+    memset(&cc->u.bbr, 0, sizeof(cc->u.bbr));
+    cc->u.bbr.mode = BBR_STARTUP;
+}
+
+static double bbrPacingGain(congestion_control *cc) {
+    switch (cc->u.bbr.mode) {
+    case BBR_STARTUP:
+        return BBR_HIGH_GAIN;
+    case BBR_DRAIN:
+        return 1 / BBR_HIGH_GAIN;
+    default:
+        return bbr_cycle_gains[cc->u.bbr.cycle];
+    }
+}
+
+static double bbrBdp(congestion_control *cc) {
+    return cc->u.bbr.btl_bw * cc->u.bbr.min_rtt / 1e6;
+}
+
+/* Takes a delivery rate sample for a round that just ended */
+static void bbrEndRound(congestion_control *cc, double bw) {
+    int i;
+    cc->u.bbr.round = (cc->u.bbr.round + 1) % 10;
+    cc->u.bbr.bw_samples[cc->u.bbr.round] = bw;
+    cc->u.bbr.btl_bw = 0;
+    for (i = 0; i < 10; i++)
+        if (cc->u.bbr.bw_samples[i] > cc->u.bbr.btl_bw)
+            cc->u.bbr.btl_bw = cc->u.bbr.bw_samples[i];
+
+    if (cc->u.bbr.mode == BBR_STARTUP) {
+        if (cc->u.bbr.btl_bw >= cc->u.bbr.full_bw * 1.25) {
+            cc->u.bbr.full_bw = cc->u.bbr.btl_bw;
+            cc->u.bbr.full_bw_rounds = 0;
+        } else if (++cc->u.bbr.full_bw_rounds >= 3) {
+            cc->u.bbr.mode = BBR_DRAIN;
+        }
+    } else if (cc->u.bbr.mode == BBR_PROBE_BW) {
+        cc->u.bbr.cycle = (cc->u.bbr.cycle + 1) % 8;
+    }
+}
+
+static void bbrOnAck(congestion_control *cc, const ack_sample *sample) {
+    if (sample->rtt > 0 &&
+        (cc->u.bbr.min_rtt == 0 || sample->rtt <= cc->u.bbr.min_rtt ||
+         sample->now - cc->u.bbr.min_rtt_stamp > BBR_MIN_RTT_WINDOW)) {
+        cc->u.bbr.min_rtt = sample->rtt;
+        cc->u.bbr.min_rtt_stamp = sample->now;
+    }
+
+    // A round lasts at least one minimum round-trip time, and the bytes
+    // acknowledged during it give a delivery rate
+    if (cc->u.bbr.round_start == 0)
+        cc->u.bbr.round_start = sample->now;
+    cc->u.bbr.round_delivered += sample->acked;
+    unsigned long long elapsed = sample->now - cc->u.bbr.round_start;
+    if (cc->u.bbr.min_rtt > 0 && elapsed >= cc->u.bbr.min_rtt) {
+        bbrEndRound(cc, cc->u.bbr.round_delivered * 1e6 / elapsed);
+        cc->u.bbr.round_start = sample->now;
+        cc->u.bbr.round_delivered = 0;
+    }
+
+    double bdp = bbrBdp(cc);
+    if (cc->u.bbr.mode == BBR_DRAIN && sample->in_flight <= bdp) {
+        cc->u.bbr.mode = BBR_PROBE_BW;
+        cc->u.bbr.cycle = 2;
+    }
+
+    // The window grows by what was acknowledged, up to its target
+    // once startup is over
+    cc->cwnd += sample->acked;
+    if (cc->u.bbr.mode != BBR_STARTUP)
+        cc->cwnd = min(cc->cwnd, max(BBR_CWND_GAIN * bdp, INITIAL_WINDOW));
+    cc->cwnd = min(cc->cwnd, STCP_MAXWIN);
+}
+
+static void bbrOnLoss(congestion_control *cc, unsigned int in_flight, unsigned long long now) {
+    // The model, not losses, sets the window
+}
+
+static void bbrOnRto(congestion_control *cc, unsigned int in_flight, unsigned long long now) {
+    cc->cwnd = MSS;
+}
+
+static unsigned long bbrPacingRate(congestion_control *cc) {
+    return bbrPacingGain(cc) * cc->u.bbr.btl_bw;
+}
+
+const congestion_ops bbr_ops = {
+    "bbr", bbrInit, bbrOnAck, bbrOnLoss, bbrOnRto, bbrPacingRate, currentWindow
+};
+
+static const congestion_ops *algorithms[] = { &reno_ops, &cubic_ops, &bbr_ops };
+
+/*
+ * Returns the algorithm with the given name, or NULL if there is none.
+ */
+const congestion_ops *congestionLookup(const char *name) {
+    int i;
+    for (i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++)
+        if (strcmp(algorithms[i]->name, name) == 0)
+            return algorithms[i];
+    return NULL;
+}
+
+void congestionInit(congestion_control *cc, const congestion_ops *ops) {
+    cc->ops = ops;
+    ops->init(cc);
+}
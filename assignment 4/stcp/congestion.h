@@ -0,0 +1,73 @@
+#ifndef __CONGESTION_H__
+#define __CONGESTION_H__
+
+/*
+ * Congestion control algorithms for the STCP sender.
+ *
+ * The sender keeps a congestion_control per connection and calls into
+ * its algorithm as ACKs and losses happen. The algorithm decides the
+ * congestion window and, optionally, a pacing rate; the sender still
+ * detects losses and does the retransmissions (including the window
+ * inflation of fast recovery).
+ */
+
+typedef struct congestion_control congestion_control;
+
+/* What an ACK of new data tells the algorithm */
+typedef struct ack_sample {
+    unsigned int acked;         /* Bytes newly acknowledged */
+    unsigned int in_flight;     /* Bytes in flight after the ACK */
+    long rtt;                   /* Round-trip time sample in us, 0 if none (Karn's rule) */
+    int in_recovery;            /* Whether fast recovery is still going on */
+    unsigned long long now;     /* Monotonic time in us */
+} ack_sample;
+
+typedef struct congestion_ops {
+    const char *name;
+    void (*init)(congestion_control *cc);
+    void (*on_ack)(congestion_control *cc, const ack_sample *sample);
+    /* A loss detected by duplicate ACKs */
+    void (*on_loss)(congestion_control *cc, unsigned int in_flight, unsigned long long now);
+    /* The retransmission timer expired */
+    void (*on_rto)(congestion_control *cc, unsigned int in_flight, unsigned long long now);
+    /* Bytes per second to pace transmissions at, 0 for no pacing */
+    unsigned long (*pacing_rate)(congestion_control *cc);
+    /* Bytes allowed in flight */
+    unsigned int (*cwnd)(congestion_control *cc);
+} congestion_ops;
+
+struct congestion_control {
+    const congestion_ops *ops;
+    unsigned int cwnd;          /* Bytes */
+    unsigned int ssthresh;      /* Bytes */
+    union {
+        struct {
+            double w_max;       /* Segments, window before the last reduction */
+            double k;           /* Seconds, for the window to grow back to w_max */
+            double w_est;       /* Segments, what Reno would have reached */
+            unsigned long long epoch_start;
+        } cubic;
+        struct {
+            int mode;
+            double btl_bw;      /* Bytes per second, windowed maximum */
+            double bw_samples[10];  /* Maximum of each recent round */
+            int round;
+            long min_rtt;       /* us */
+            unsigned long long min_rtt_stamp;
+            unsigned long long round_start;
+            unsigned int round_delivered;
+            double full_bw;     /* Bandwidth when startup last grew */
+            int full_bw_rounds;
+            int cycle;          /* Phase of the probing cycle */
+        } bbr;
+    } u;
+};
+
+extern const congestion_ops reno_ops;
+extern const congestion_ops cubic_ops;
+extern const congestion_ops bbr_ops;
+
+extern const congestion_ops *congestionLookup(const char *name);
+extern void congestionInit(congestion_control *cc, const congestion_ops *ops);
+
+#endif
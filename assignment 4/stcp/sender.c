@@ -22,19 +22,68 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/file.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 #include "stcp.h"
+#include "congestion.h"
 
 #define STCP_SUCCESS 1
 #define STCP_ERROR -1
 
 int debug = 1;
 
-typedef struct window_node
+/* Bounds on the retransmission timeout, in ms (options -m and -M) */
+#define STCP_DEFAULT_MIN_RTO 5
+int min_rto = STCP_DEFAULT_MIN_RTO;
+int max_rto = STCP_MAX_TIMEOUT;
+
+/* Congestion control algorithm (option -c) */
+const congestion_ops *congestion = &reno_ops;
+
+/* Pacing may send a segment up to this early (us), as timeouts have a
+ * granularity of 1 ms */
+#define STCP_PACING_SLACK 1000
+
+/* Most segments sent, or ACKs read, with one system call */
+#define STCP_BATCH 32
+
+/* Whether to hand bursts to the kernel as runs of equal-size segments
+ * for it to split (UDP_SEGMENT, option -g) */
+int segmentation_offload = 0;
+
+/* SACK blocks that fit in the 40 bytes of TCP options */
+#define STCP_MAX_SACK_BLOCKS 4
+
+/* The send window holds every segment queued but not yet acknowledged,
+ * oldest first, in a circular array of slots. A full window of
+ * maximum-size segments fits, and stcp_send() waits for ACKs before
+ * queueing a segment into a full array, so nothing on the data path is
+ * allocated. The first window_sent segments have been transmitted;
+ * how many may be is limited by both the receiver's advertised window
+ * and the congestion window (plus its inflation in fast recovery), and
+ * when they may be by the algorithm's pacing rate.
+ *
+ * If the receiver agreed to selective acknowledgements, segments it
+ * reports holding are marked as SACKed; they no longer count as in
+ * flight, and in loss recovery the holes below the highest SACKed
+ * segment are taken as lost and retransmitted, within the congestion
+ * window, in a single round trip (RFC 6675, simplified). */
+#define STCP_WINDOW_SLOTS (STCP_MAXWIN / STCP_MSS + 1)
+
+/* A segment of the send window. The wire bytes are built once, in
+ * network order, and only ever sent again; the window is managed with
+ * the host-order copies kept alongside. */
+typedef struct
 {
-    packet *packet;
-    struct window_node *next;
-} window_node_t;
+    unsigned int seq;
+    int len;                      // Payload bytes
+    unsigned long long sent_at;   // Microseconds, at the latest transmission (0 if never sent)
+    int retransmits;
+    unsigned char sacked;
+    int recovery;                 // Loss recovery in which it was last retransmitted
+    packet packet;
+} window_segment_t;
 
 typedef struct
 {
@@ -44,10 +93,25 @@ typedef struct
     unsigned int current_acknowledgement_number;
     unsigned int last_acknowledgement_number;
     unsigned char repeat_acknowledgements;
-    unsigned short number_of_bytes_in_flight;
+    unsigned int number_of_bytes_in_flight;
     unsigned short maximum_window_size;
-    window_node_t *window_head;
-    window_node_t *window_tail;
+    window_segment_t window[STCP_WINDOW_SLOTS];
+    int window_head;  // Slot of the oldest unacknowledged segment
+    int window_count; // Segments in the window
+    int window_sent;  // Segments transmitted, from the oldest
+    congestion_control cc;
+    unsigned int recover;    // Highest sequence number sent when loss recovery began
+    unsigned char in_recovery;
+    unsigned int inflation;  // Bytes added to the congestion window in fast recovery
+    unsigned long long next_send_at; // Microseconds, when pacing allows the next segment
+    unsigned char sack_permitted;
+    unsigned int sacked_bytes;      // Bytes of transmitted segments SACKed
+    unsigned int highest_sacked;    // Sequence number after the highest SACKed segment
+    int recoveries;                 // Loss recoveries entered
+    unsigned char segmentation_offload;  // Cleared if the kernel cannot segment
+    long srtt;        // Smoothed round-trip time, us (0 before the first sample)
+    long rttvar;      // Round-trip time variation, us
+    int rto;          // Retransmission timeout, ms
     int fd;
 
 } stcp_send_ctrl_blk;
@@ -73,8 +137,10 @@ void createPacket(packet *pkt, int flags, unsigned short rwnd, unsigned int seq,
     hdr->seqNo = seq;
     hdr->ackNo = ack;
     hdr->windowSize = rwnd;
-    hdr->flags = (5 << 12) | flags;
+    hdr->dataOffset = 5;
+    hdr->flags = flags;
     hdr->checksum = 0;
+    hdr->urgentPointer = 0;
     if (data != NULL)
         memcpy(sizeof(tcpheader) + pkt->data, data, len);
     htonHdr(hdr);
@@ -88,155 +154,588 @@ void createReceivingPacket(packet *packet, unsigned char *data, int len)
 
 void sendSYN(stcp_send_ctrl_blk *cb)
 {
-    // create SYN packet
-    packet *syn_packet = malloc(sizeof(packet));
-    createPacket(syn_packet, SYN, 0, cb->current_sequence_Number, cb->current_acknowledgement_number, NULL, 0);
+    // create SYN packet, offering selective acknowledgements
+    unsigned char options[4] = {TCP_OPTION_SACK_PERMITTED, 2, TCP_OPTION_NOP, TCP_OPTION_NOP};
+    packet syn_packet;
+    createPacket(&syn_packet, SYN, 0, cb->current_sequence_Number, cb->current_acknowledgement_number, options, sizeof(options));
+    syn_packet.hdr->dataOffset = 5 + sizeof(options) / 4;
+    syn_packet.hdr->checksum = 0;
+    syn_packet.hdr->checksum = ipchecksum(syn_packet.data, syn_packet.len);
     if (debug)
         logLog("init", "Created SYN packet:");
 
     // Send SYN packet
-    send(cb->fd, syn_packet, syn_packet->len, 0);
-    free(syn_packet);
+    send(cb->fd, syn_packet.data, syn_packet.len, 0);
 
     if (debug)
         logLog("init", "Sent SYN packet");
 }
 
-void moveWindow(stcp_send_ctrl_blk *cb, int recieved_acknowledgement_number)
+/*
+ * Returns a monotonic time in microseconds.
+ */
+unsigned long long currentTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Returns the i-th segment of the send window, counting from the oldest
+ * unacknowledged one.
+ */
+window_segment_t *windowSegment(stcp_send_ctrl_blk *cb, int i)
+{
+    return &cb->window[(cb->window_head + i) % STCP_WINDOW_SLOTS];
+}
+
+/*
+ * Folds a round-trip time sample (us) into the smoothed estimate and
+ * recomputes the retransmission timeout, as in RFC 6298 with a clock
+ * granularity of 1 ms.
+ */
+void updateRTO(stcp_send_ctrl_blk *cb, long rtt)
 {
-    while (cb->window_head != NULL)
+    if (cb->srtt == 0)
     {
-        window_node_t *temp_node = cb->window_head->next;
-        ntohHdr(cb->window_head->packet->hdr);
-        if (recieved_acknowledgement_number == cb->window_head->packet->hdr->seqNo)
-        {
-            htonHdr(cb->window_head->packet->hdr);
+        cb->srtt = max(rtt, 1);
+        cb->rttvar = rtt / 2;
+    }
+    else
+    {
+        long delta = cb->srtt > rtt ? cb->srtt - rtt : rtt - cb->srtt;
+        cb->rttvar = (3 * cb->rttvar + delta) / 4;
+        cb->srtt = max((7 * cb->srtt + rtt) / 8, 1);
+    }
+    long rto = cb->srtt + (4 * cb->rttvar > 1000 ? 4 * cb->rttvar : 1000);
+    cb->rto = max(min_rto, min((rto + 999) / 1000, max_rto));
+}
+
+/*
+ * Doubles the retransmission timeout after it expired. It stays backed
+ * off until an ACK gives a new round-trip time sample.
+ */
+void backOffRTO(stcp_send_ctrl_blk *cb)
+{
+    cb->rto = min(cb->rto * 2, max_rto);
+}
+
+/*
+ * Drops from the send window every segment that received_ack
+ * acknowledges in full. The newest of them gives a round-trip time
+ * sample, unless (Karn's rule) any of them was retransmitted, as the
+ * ACK could then be for an earlier transmission.
+ *
+ * Returns the round-trip time sample in us, or 0 if there is none.
+ */
+long moveWindow(stcp_send_ctrl_blk *cb, unsigned int received_ack)
+{
+    unsigned long long sent_at = 0;
+    int retransmitted = 0;
+
+    while (cb->window_count > 0)
+    {
+        window_segment_t *segment = windowSegment(cb, 0);
+        if (greater32(plus32(segment->seq, segment->len), received_ack))
             break;
-        }
 
-        cb->number_of_bytes_in_flight -= cb->window_head->packet->len;
-        free(cb->window_head->packet);
-        free(cb->window_head);
-        cb->window_head = temp_node;
+        sent_at = segment->sent_at;
+        retransmitted |= segment->retransmits > 0;
+        if (segment->sacked)
+            cb->sacked_bytes -= segment->len;
+        if (cb->window_sent > 0)
+        {
+            cb->number_of_bytes_in_flight -= segment->len;
+            cb->window_sent--;
+        }
+        cb->window_head = (cb->window_head + 1) % STCP_WINDOW_SLOTS;
+        cb->window_count--;
     }
+
+    if (sent_at == 0 || retransmitted)
+        return 0;
+    long rtt = max(currentTime() - sent_at, 1);
+    updateRTO(cb, rtt);
+    return rtt;
 }
+
+/*
+ * Sends the oldest unacknowledged segment again.
+ */
 void retransmitWindow(stcp_send_ctrl_blk *cb)
 {
-    int number_of_bytes_read = 0;
-    unsigned char buffer[STCP_MTU];
+    if (cb->window_count == 0)
+        return;
 
-    // Process the buffer until it is empty
-    while (number_of_bytes_read > 0)
-    {
-        number_of_bytes_read = readWithTimeout(cb->fd, buffer, 0);
+    window_segment_t *segment = windowSegment(cb, 0);
+    logLog("segment", "Retransmitting the oldest unacknowledged segment (seq %u, %d bytes)", segment->seq, segment->len);
+    segment->sent_at = currentTime();
+    segment->retransmits++;
+    segment->recovery = cb->recoveries;
+    send(cb->fd, segment->packet.data, segment->packet.len, MSG_NOSIGNAL);
+}
 
-        if (number_of_bytes_read <= 0)
-        {
+/*
+ * Queues a new segment with the given payload after the newest segment
+ * of the window, and returns it. The window must not be full.
+ */
+window_segment_t *appendPacketToWindow(stcp_send_ctrl_blk *cb, unsigned char *data, int len)
+{
+    assert(cb->window_count < STCP_WINDOW_SLOTS);
+    window_segment_t *segment = windowSegment(cb, cb->window_count++);
+    segment->seq = cb->current_sequence_Number;
+    segment->len = len;
+    segment->sent_at = 0;
+    segment->retransmits = 0;
+    segment->sacked = 0;
+    segment->recovery = -1;
+    createPacket(&segment->packet, ACK, 0, segment->seq, cb->current_acknowledgement_number, data, len);
+    return segment;
+}
+
+/*
+ * Returns the congestion window, including its inflation in fast
+ * recovery.
+ */
+unsigned int congestionWindow(stcp_send_ctrl_blk *cb)
+{
+    return cb->cc.ops->cwnd(&cb->cc) + cb->inflation;
+}
+
+/*
+ * Returns whether the i-th segment of the window is taken as lost in
+ * the current loss recovery, and not yet retransmitted in it: with
+ * selective acknowledgements, any segment not SACKed below the highest
+ * SACKed one, and in any case the oldest segment.
+ */
+int segmentLost(stcp_send_ctrl_blk *cb, int i, window_segment_t *segment)
+{
+    if (!cb->in_recovery || segment->sacked || segment->recovery == cb->recoveries)
+        return 0;
+    return i == 0 || (cb->sack_permitted && greater32(cb->highest_sacked, segment->seq));
+}
+
+/*
+ * Returns the bytes taken to be still in the network: those in flight,
+ * less those SACKed and those lost.
+ */
+unsigned int outstandingBytes(stcp_send_ctrl_blk *cb)
+{
+    if (!cb->sack_permitted)
+        return cb->number_of_bytes_in_flight;
+
+    unsigned int outstanding = cb->number_of_bytes_in_flight - cb->sacked_bytes;
+    for (int i = 0; cb->in_recovery && i < cb->window_sent; i++)
+    {
+        window_segment_t *segment = windowSegment(cb, i);
+        if (i > 0 && !greater32(cb->highest_sacked, segment->seq))
             break;
-        }
+        if (segmentLost(cb, i, segment))
+            outstanding -= segment->len;
+    }
+    return outstanding;
+}
 
-        packet ack_data_packet;
-        createReceivingPacket(&ack_data_packet, buffer, number_of_bytes_read);
+/*
+ * Sends a batch of segments with one system call, with segmentation
+ * offload if it is on. The first time the kernel turns that down, the
+ * rest of the batch, and every later one, goes segment by segment. Any
+ * other error (e.g. ENOBUFS) only sends the rest of this batch segment
+ * by segment: the segments already count as in flight, and waiting for
+ * their retransmission timeout would stall the window.
+ */
+void sendBatch(stcp_send_ctrl_blk *cb, packet **batch, int count)
+{
+    int sent = 0;
 
-        if (ipchecksum(buffer, number_of_bytes_read) != 0)
+    if (cb->segmentation_offload)
+    {
+        sent = sendSegmented(cb->fd, batch, count);
+        if (sent == count)
+            return;
+        if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
         {
-            logLog("init", "Checksum did not return 0. Ignoring ACK packet.");
-            number_of_bytes_read = 0;
-            continue;
+            logLog("init", "No UDP segmentation offload (%s), sending segments one by one", strerror(errno));
+            cb->segmentation_offload = 0;
         }
+        else
+            logLog("segment", "Segmented send stopped after %d of %d segments (%s)", sent, count, strerror(errno));
+    }
+    sendMany(cb->fd, batch + sent, count - sent);
+}
 
-        logLog("init", "Received %d bytes from receiver.", number_of_bytes_read);
+/*
+ * Transmits the queued segments that the receiver's window and the
+ * congestion window allow, as fast as pacing allows. With nothing in
+ * flight one segment is always sent, so that a window advertised as too
+ * small (or zero) is probed rather than waited on forever.
+ */
+void transmitWindow(stcp_send_ctrl_blk *cb)
+{
+    unsigned int window = min(congestionWindow(cb), cb->maximum_window_size);
+    unsigned long rate = cb->cc.ops->pacing_rate(&cb->cc);
+    unsigned int outstanding = outstandingBytes(cb);
+    packet *batch[STCP_BATCH];
+    int batched = 0;
 
-        ntohHdr(ack_data_packet.hdr);
-        unsigned int recieved_acknowledgement_number = ack_data_packet.hdr->ackNo;
-        logLog("init", "Received a ACK packet: %d", recieved_acknowledgement_number);
+    while (cb->window_sent < cb->window_count)
+    {
+        window_segment_t *segment = windowSegment(cb, cb->window_sent);
+        if (outstanding > 0 && outstanding + segment->len > window)
+            break;
 
-        cb->maximum_window_size = min(ack_data_packet.hdr->windowSize, STCP_MAXWIN);
+        unsigned long long now = currentTime();
+        if (rate > 0)
+        {
+            if (cb->next_send_at > now + STCP_PACING_SLACK)
+                break;
+            if (cb->next_send_at < now)
+                cb->next_send_at = now;
+            cb->next_send_at += segment->packet.len * 1000000ULL / rate;
+        }
 
-        moveWindow(cb, recieved_acknowledgement_number);
-        return;
+        if (segment->sent_at != 0)
+            segment->retransmits++;
+        segment->sent_at = now;
+        batch[batched++] = &segment->packet;
+        if (batched == STCP_BATCH)
+        {
+            sendBatch(cb, batch, batched);
+            batched = 0;
+        }
+        cb->number_of_bytes_in_flight += segment->len;
+        outstanding += segment->len;
+        cb->window_sent++;
     }
+    if (batched > 0)
+        sendBatch(cb, batch, batched);
+}
+
+/*
+ * In loss recovery with selective acknowledgements, retransmits the
+ * segments taken as lost, oldest first, as far as the congestion window
+ * allows.
+ */
+void retransmitHoles(stcp_send_ctrl_blk *cb)
+{
+    unsigned int window = min(congestionWindow(cb), cb->maximum_window_size);
+    unsigned int outstanding = outstandingBytes(cb);
+    packet *batch[STCP_BATCH];
+    int batched = 0;
 
-    // Find the data packet with the specified sequence no and resend it
-    packet *packet_to_resend = NULL;
-    window_node_t *temp_node = cb->window_head;
-    while (temp_node != NULL)
+    for (int i = 0; i < cb->window_sent; i++)
     {
-        ntohHdr(temp_node->packet->hdr);
-        if (cb->last_acknowledgement_number == temp_node->packet->hdr->seqNo)
-        {
-            htonHdr(temp_node->packet->hdr);
-            packet_to_resend = temp_node->packet;
+        window_segment_t *segment = windowSegment(cb, i);
+        if (i > 0 && !greater32(cb->highest_sacked, segment->seq))
             break;
+        if (!segmentLost(cb, i, segment))
+            continue;
+        if (outstanding > 0 && outstanding + segment->len > window)
+            break;
+
+        logLog("segment", "Retransmitting a hole (seq %u, %d bytes)", segment->seq, segment->len);
+        segment->sent_at = currentTime();
+        segment->retransmits++;
+        segment->recovery = cb->recoveries;
+        batch[batched++] = &segment->packet;
+        if (batched == STCP_BATCH)
+        {
+            sendBatch(cb, batch, batched);
+            batched = 0;
         }
-        temp_node = temp_node->next;
+        outstanding += segment->len;
     }
-    if (packet_to_resend == NULL)
-        return;
-
-    send(cb->fd, packet_to_resend, packet_to_resend->len, MSG_NOSIGNAL);
+    if (batched > 0)
+        sendBatch(cb, batch, batched);
+}
 
-    number_of_bytes_read = 0;
-    int timeout = STCP_INITIAL_TIMEOUT * 2;
+/*
+ * Reads the TCP options of a received segment into blocks (up to
+ * STCP_MAX_SACK_BLOCKS SACK blocks, host order) and, unless it is NULL,
+ * *sack_permitted. Returns the number of SACK blocks.
+ */
+int parseOptions(unsigned char *buffer, int len, unsigned int blocks[][2], int *sack_permitted)
+{
+    tcpheader *hdr = (tcpheader *)buffer;
+    int end = hdr->dataOffset * 4;
+    int count = 0;
 
-    // Wait for ACK for the resent data
-    while (number_of_bytes_read <= 0)
+    if (end <= sizeof(tcpheader) || end > len)
+        return 0;
+    for (int i = sizeof(tcpheader); i < end && buffer[i] != TCP_OPTION_END;)
     {
-        number_of_bytes_read = readWithTimeout(cb->fd, buffer, timeout);
+        if (buffer[i] == TCP_OPTION_NOP)
+        {
+            i++;
+            continue;
+        }
+        int option_len = i + 1 < end ? buffer[i + 1] : 0;
+        if (option_len < 2 || i + option_len > end)
+            break;
 
-        if (number_of_bytes_read == STCP_READ_TIMED_OUT)
+        if (buffer[i] == TCP_OPTION_SACK_PERMITTED && sack_permitted != NULL)
+            *sack_permitted = 1;
+        else if (buffer[i] == TCP_OPTION_SACK && blocks != NULL)
         {
-            send(cb->fd, cb->window_head->packet->data, cb->window_head->packet->len, MSG_NOSIGNAL);
-            timeout = min(timeout * 2, STCP_MAX_TIMEOUT);
+            for (int j = i + 2; j + 8 <= i + option_len && count < STCP_MAX_SACK_BLOCKS; j += 8)
+            {
+                unsigned int edge;
+                memcpy(&edge, buffer + j, 4);
+                blocks[count][0] = ntohl(edge);
+                memcpy(&edge, buffer + j + 4, 4);
+                blocks[count][1] = ntohl(edge);
+                count++;
+            }
         }
+        i += option_len;
+    }
+    return count;
+}
 
-        else if (number_of_bytes_read == STCP_READ_PERMANENT_FAILURE)
-            return;
+/*
+ * Marks as SACKed the transmitted segments that the SACK blocks of a
+ * received segment cover.
+ */
+void updateScoreboard(stcp_send_ctrl_blk *cb, unsigned char *buffer, int len)
+{
+    unsigned int blocks[STCP_MAX_SACK_BLOCKS][2];
+    int count = parseOptions(buffer, len, blocks, NULL);
 
-        if (ipchecksum(buffer, number_of_bytes_read) != 0)
+    for (int b = 0; b < count; b++)
+    {
+        for (int i = 0; i < cb->window_sent; i++)
         {
-            logLog("init", "Checksum did not return 0. Ignoring ACK packet.");
-            number_of_bytes_read = 0;
-            continue;
+            window_segment_t *segment = windowSegment(cb, i);
+            unsigned int end = plus32(segment->seq, segment->len);
+            if (!greater32(blocks[b][1], segment->seq))
+                break;
+            if (segment->sacked || greater32(blocks[b][0], segment->seq) || greater32(end, blocks[b][1]))
+                continue;
+
+            segment->sacked = 1;
+            cb->sacked_bytes += segment->len;
+            if (greater32(end, cb->highest_sacked))
+                cb->highest_sacked = end;
         }
+    }
+}
 
-        logLog("init", "Received %d bytes from receiver.", number_of_bytes_read);
+/*
+ * Returns how many ms pacing holds back the next queued segment, or 0
+ * if nothing is held back by pacing.
+ */
+int pacingDelay(stcp_send_ctrl_blk *cb)
+{
+    if (cb->window_sent == cb->window_count || cb->cc.ops->pacing_rate(&cb->cc) == 0)
+        return 0;
+    unsigned long long now = currentTime();
+    if (cb->next_send_at <= now + STCP_PACING_SLACK)
+        return 0;
+    return (cb->next_send_at - now - STCP_PACING_SLACK + 999) / 1000;
+}
 
-        packet ack_data_packet;
-        createReceivingPacket(&ack_data_packet, buffer, number_of_bytes_read);
-        unsigned int recieved_acknowledgement_number = ack_data_packet.hdr->ackNo;
-        logLog("init", "Received an ACK packet: %d", recieved_acknowledgement_number);
+/*
+ * Returns the sequence number following the last segment transmitted.
+ */
+unsigned int sentEnd(stcp_send_ctrl_blk *cb)
+{
+    if (cb->window_sent == 0)
+        return cb->last_acknowledgement_number;
+    window_segment_t *segment = windowSegment(cb, cb->window_sent - 1);
+    return plus32(segment->seq, segment->len);
+}
 
-        cb->maximum_window_size = min(ack_data_packet.hdr->windowSize, STCP_MAXWIN);
-        moveWindow(cb, recieved_acknowledgement_number);
+/*
+ * Handles an ACK of acked new bytes. In fast recovery a full ACK (of
+ * everything sent when the loss was detected) ends the recovery, while
+ * a partial ACK shows the next hole, which is retransmitted at once
+ * (NewReno). The congestion control algorithm then sees the ACK.
+ */
+void newAck(stcp_send_ctrl_blk *cb, unsigned int acked, long rtt)
+{
+    ack_sample sample;
+    sample.acked = acked;
+    sample.rtt = rtt;
+    sample.in_recovery = cb->in_recovery;
+    sample.now = currentTime();
 
-        if (recieved_acknowledgement_number == cb->last_acknowledgement_number)
-            return;
-        else
+    if (cb->in_recovery)
+    {
+        if (!greater32(cb->recover, cb->last_acknowledgement_number))
         {
-            cb->last_acknowledgement_number = recieved_acknowledgement_number;
-            cb->repeat_acknowledgements = 1;
-            return;
+            cb->in_recovery = 0;
+            cb->inflation = 0;
+            logLog("segment", "Recovered, cwnd %u", congestionWindow(cb));
+        }
+        else if (!cb->sack_permitted)
+        {
+            retransmitWindow(cb);
+            cb->inflation = (cb->inflation > acked ? cb->inflation - acked : 0) + STCP_MSS;
         }
     }
-    return;
+
+    sample.in_flight = cb->number_of_bytes_in_flight;
+    cb->cc.ops->on_ack(&cb->cc, &sample);
+}
+
+/*
+ * Counts a duplicate ACK. The third one starts fast retransmit and
+ * fast recovery, unless it is for data sent before the latest loss was
+ * detected; each further one shows a segment has left the network and,
+ * without selective acknowledgements to tell which, inflates the
+ * congestion window by one.
+ */
+void duplicateAck(stcp_send_ctrl_blk *cb)
+{
+    if (cb->repeat_acknowledgements < 255)
+        cb->repeat_acknowledgements++;
+
+    if (cb->in_recovery)
+    {
+        if (!cb->sack_permitted)
+            cb->inflation = min(cb->inflation + STCP_MSS, STCP_MAXWIN);
+    }
+    else if (cb->repeat_acknowledgements == 3 &&
+             greater32(cb->last_acknowledgement_number, cb->recover))
+    {
+        cb->cc.ops->on_loss(&cb->cc, cb->number_of_bytes_in_flight, currentTime());
+        cb->recover = sentEnd(cb);
+        cb->inflation = cb->sack_permitted ? 0 : 3 * STCP_MSS;
+        cb->in_recovery = 1;
+        cb->recoveries++;
+        logLog("segment", "Fast retransmit, cwnd %u", congestionWindow(cb));
+        retransmitWindow(cb);
+    }
+}
+
+/*
+ * Handles the expiry of the retransmission timer: the congestion window
+ * shrinks (to one segment, with the loss-based algorithms), and
+ * everything in flight is sent again as it allows, starting with the
+ * oldest segment.
+ */
+void retransmissionTimeout(stcp_send_ctrl_blk *cb)
+{
+    cb->cc.ops->on_rto(&cb->cc, cb->number_of_bytes_in_flight, currentTime());
+    cb->recover = sentEnd(cb);
+    cb->repeat_acknowledgements = 0;
+    cb->in_recovery = 0;
+    cb->inflation = 0;
+    backOffRTO(cb);
+    logLog("segment", "Retransmission timeout, cwnd %u rto %d ms", congestionWindow(cb), cb->rto);
+
+    // The receiver may have dropped what it SACKed
+    for (int i = 0; i < cb->window_count; i++)
+        windowSegment(cb, i)->sacked = 0;
+    cb->sacked_bytes = 0;
+    cb->highest_sacked = cb->last_acknowledgement_number;
+
+    cb->window_sent = 0;
+    cb->number_of_bytes_in_flight = 0;
+    transmitWindow(cb);
 }
-void appendPacketToWindow(stcp_send_ctrl_blk *cb, packet *packet)
+
+/*
+ * Processes a segment read from the receiver: updates the advertised
+ * window, releases the acknowledged segments and updates the congestion
+ * window. What it then allows is sent by the caller.
+ *
+ * Returns 1 if the segment acknowledged new data, 0 otherwise.
+ */
+int processAck(stcp_send_ctrl_blk *cb, unsigned char *buffer, int len)
 {
-    if (cb->window_head == NULL)
+    if (ipchecksum(buffer, len) != 0)
+    {
+        logLog("init", "Checksum did not return 0. Ignoring ACK packet.");
+        return 0;
+    }
+
+    packet ack_packet;
+    createReceivingPacket(&ack_packet, buffer, len);
+    if (!getAck(ack_packet.hdr))
+        return 0;
+
+    unsigned int received_ack = ack_packet.hdr->ackNo;
+    logLog("init", "Received an ACK packet: %u", received_ack);
+    cb->maximum_window_size = min(ack_packet.hdr->windowSize, STCP_MAXWIN);
+
+    int advanced = 0;
+    unsigned int acked = 0;
+    long rtt = 0;
+    if (greater32(received_ack, cb->last_acknowledgement_number))
     {
-        cb->window_head = malloc(sizeof(window_node_t));
-        cb->window_head->packet = packet;
-        cb->window_head->next = NULL;
-        cb->window_tail = cb->window_head;
+        acked = minus32(received_ack, cb->last_acknowledgement_number);
+        cb->last_acknowledgement_number = received_ack;
+        cb->repeat_acknowledgements = 0;
+        rtt = moveWindow(cb, received_ack);
+        advanced = 1;
     }
+    if (cb->sack_permitted)
+        updateScoreboard(cb, buffer, len);
+
+    if (advanced)
+        newAck(cb, acked, rtt);
+    else if (received_ack == cb->last_acknowledgement_number && cb->window_sent > 0)
+        duplicateAck(cb);
+
+    return advanced;
+}
+
+/*
+ * Waits for segments from the receiver and processes all that arrived,
+ * then sends what the updated windows allow. The wait
+ * ends when the retransmission timer, which runs from the latest
+ * transmission of the oldest unacknowledged segment, expires (see
+ * retransmissionTimeout()), or when pacing lets the next segment go.
+ *
+ * Returns STCP_SUCCESS, or STCP_ERROR if the connection failed.
+ */
+int awaitAck(stcp_send_ctrl_blk *cb)
+{
+    int timeout = cb->rto;
+    if (cb->window_sent > 0)
+    {
+        long elapsed = (currentTime() - windowSegment(cb, 0)->sent_at) / 1000;
+        timeout = max(cb->rto - elapsed, 0);
+    }
+    int paced = pacingDelay(cb);
+    if (paced > 0 && paced < timeout)
+        timeout = paced;
     else
+        paced = 0;
+
+    unsigned char buffers[STCP_BATCH][STCP_MTU];
+    int lengths[STCP_BATCH];
+    int count = readManyWithTimeout(cb->fd, buffers, lengths, STCP_BATCH, timeout);
+
+    if (count == STCP_READ_PERMANENT_FAILURE)
+        return STCP_ERROR;
+    if (count == STCP_READ_TIMED_OUT)
     {
-        cb->window_tail->next = malloc(sizeof(window_node_t));
-        cb->window_tail = cb->window_tail->next;
-        cb->window_tail->packet = packet;
-        cb->window_tail->next = NULL;
+        if (!paced && cb->window_sent > 0)
+            retransmissionTimeout(cb);
+        else
+            transmitWindow(cb);
+        return STCP_SUCCESS;
     }
+
+    for (int i = 0; i < count; i++)
+        processAck(cb, buffers[i], lengths[i]);
+    if (cb->in_recovery && cb->sack_permitted)
+        retransmitHoles(cb);
+    transmitWindow(cb);
+    return STCP_SUCCESS;
+}
+
+/*
+ * Returns whether a full burst of segments waits to be sent, or the
+ * window has no free slot.
+ */
+int windowBacklogged(stcp_send_ctrl_blk *cb)
+{
+    return cb->window_count - cb->window_sent >= STCP_BATCH ||
+           cb->window_count == STCP_WINDOW_SLOTS;
 }
 
 /*
@@ -256,92 +755,28 @@ void appendPacketToWindow(stcp_send_ctrl_blk *cb, packet *packet)
  */
 int stcp_send(stcp_send_ctrl_blk *stcp_CB, unsigned char *data, int length)
 {
-    while (stcp_CB->number_of_bytes_in_flight >= stcp_CB->maximum_window_size)
+    while (length > 0)
     {
-        // wait for ACKs before moving window
-        unsigned char buffer[STCP_MTU];
-        int number_of_bytes_read = 0;
-        int timeout = STCP_INITIAL_TIMEOUT;
-        while (number_of_bytes_read <= 0)
-        {
-            number_of_bytes_read = readWithTimeout(stcp_CB->fd, buffer, timeout);
-            // time out case
-            if (number_of_bytes_read == STCP_READ_TIMED_OUT)
-            {
-                send(stcp_CB->fd, stcp_CB->window_head->packet, stcp_CB->window_head->packet->len, MSG_NOSIGNAL);
-                timeout = min(timeout * 2, STCP_MAX_TIMEOUT);
-            }
-            // read failure case
-            else if (number_of_bytes_read == STCP_READ_PERMANENT_FAILURE)
-            {
-                return STCP_ERROR;
-            }
-            // failed checksum case
-            if (ipchecksum(buffer, number_of_bytes_read) != 0)
-            {
-                logLog("init", "Checksum did not return 0. Ignoring ACK packet.");
-                number_of_bytes_read = 0;
-                continue;
-            }
-            logLog("init", "Recieved %d bytes from the receiver.", number_of_bytes_read);
-            packet ack_packet;
-            createReceivingPacket(&ack_packet, buffer, number_of_bytes_read);
-            unsigned int recieved_acknowledgement_number = ack_packet.hdr->ackNo;
-            logLog("init", "Received an ACK packet: %d", recieved_acknowledgement_number);
-            stcp_CB->maximum_window_size = min(ack_packet.hdr->windowSize, STCP_MAXWIN);
-
-            moveWindow(stcp_CB, recieved_acknowledgement_number);
-
-            if (stcp_CB->last_acknowledgement_number == recieved_acknowledgement_number)
-                stcp_CB->repeat_acknowledgements += 1;
-            else
-                stcp_CB->repeat_acknowledgements = 1;
-            if (stcp_CB->repeat_acknowledgements == 3)
-                retransmitWindow(stcp_CB);
-        }
-    }
+        int len = min(length, STCP_MSS);
 
-    if (stcp_CB->maximum_window_size != 0 && length > stcp_CB->maximum_window_size)
-    {
-        int remaining_length = length;
-        int number_of_packets = 0;
+        appendPacketToWindow(stcp_CB, data, len);
+        stcp_CB->current_sequence_Number = plus32(stcp_CB->current_sequence_Number, len);
 
-        while (remaining_length > 0)
+        // Segments go out in bursts: once a full one is queued, send
+        // what the window allows, and wait for ACKs to open it until
+        // less than a burst (and a free slot) is left.
+        if (windowBacklogged(stcp_CB))
         {
-            packet *data_packet = malloc(sizeof(packet));
-            createPacket(data_packet, ACK, 0, stcp_CB->current_sequence_Number, stcp_CB->current_acknowledgement_number, data, length);
-            appendPacketToWindow(stcp_CB, data_packet);
-            stcp_CB->current_sequence_Number += payloadSize(data_packet);
-
-            remaining_length -= min(stcp_CB->maximum_window_size, remaining_length);
-            data = data + min(stcp_CB->maximum_window_size, remaining_length);
-            number_of_packets++;
-        }
-
-        window_node_t *temp = stcp_CB->window_head;
-
-        for (int i = 0; i < number_of_packets; i++)
-        {
-            if (stcp_CB->number_of_bytes_in_flight + temp->packet->len <= stcp_CB->maximum_window_size)
+            transmitWindow(stcp_CB);
+            while (windowBacklogged(stcp_CB))
             {
-                send(stcp_CB->fd, temp->packet->data, temp->packet->len, MSG_NOSIGNAL);
-                stcp_CB->number_of_bytes_in_flight += payloadSize(temp->packet);
-                temp = temp->next;
-            }
-            else
-            {
-                break;
+                if (awaitAck(stcp_CB) == STCP_ERROR)
+                    return STCP_ERROR;
             }
         }
-    }
-    else
-    {
-        packet *data_packet = malloc(sizeof(packet));
-        createPacket(data_packet, ACK, 0, stcp_CB->current_sequence_Number, stcp_CB->current_acknowledgement_number, data, length);
-        stcp_CB->number_of_bytes_in_flight += payloadSize(data_packet);
-        stcp_CB->current_sequence_Number += payloadSize(data_packet);
-        send(stcp_CB->fd, data_packet, data_packet->len, MSG_NOSIGNAL);
-        appendPacketToWindow(stcp_CB, data_packet);
+
+        data += len;
+        length -= len;
     }
     return STCP_SUCCESS;
 }
@@ -381,26 +816,41 @@ stcp_send_ctrl_blk *stcp_open(char *destination, int sendersPort,
     cb->number_of_bytes_in_flight = 0;
     cb->maximum_window_size = STCP_MAXWIN;
     cb->fd = fd;
-    cb->window_head = NULL;
-    cb->window_tail = NULL;
+    cb->window_head = 0;
+    cb->window_count = 0;
+    cb->window_sent = 0;
+    congestionInit(&cb->cc, congestion);
+    cb->in_recovery = 0;
+    cb->inflation = 0;
+    cb->next_send_at = 0;
+    cb->sack_permitted = 0;
+    cb->sacked_bytes = 0;
+    cb->recoveries = 0;
+    cb->segmentation_offload = segmentation_offload;
+    cb->srtt = 0;
+    cb->rttvar = 0;
+    cb->rto = max(min_rto, min(STCP_INITIAL_TIMEOUT, max_rto));
 
     // create and send SYN packet
+    unsigned long long syn_sent_at = currentTime();
+    int syn_retransmitted = 0;
     sendSYN(cb);
 
     // wait for SYN-ACK packet
     unsigned char buffer[STCP_MTU];
     int number_of_bytes_read = 0;
-    int timeout = STCP_INITIAL_TIMEOUT;
     while (number_of_bytes_read <= 0)
     {
-        number_of_bytes_read = readWithTimeout(cb->fd, buffer, timeout);
+        number_of_bytes_read = readWithTimeout(cb->fd, buffer, cb->rto);
 
         // timeout case
         if (number_of_bytes_read == STCP_READ_TIMED_OUT)
         {
             logLog("init", "Sending another SYN packet to the receiver due to timeout.");
             sendSYN(cb);
-            timeout = min(timeout * 2, STCP_MAX_TIMEOUT);
+            syn_retransmitted = 1;
+            backOffRTO(cb);
+            continue;
         }
         // read failure case
         else if (number_of_bytes_read == STCP_READ_PERMANENT_FAILURE)
@@ -424,14 +874,29 @@ stcp_send_ctrl_blk *stcp_open(char *destination, int sendersPort,
             cb->current_acknowledgement_number = synack_packet.hdr->seqNo + 1;
             cb->current_sequence_Number = synack_packet.hdr->ackNo;
             cb->last_acknowledgement_number = synack_packet.hdr->ackNo;
-            cb->last_acknowledgement_number = 1;
+            cb->recover = cb->current_sequence_Number;
+            cb->highest_sacked = cb->current_sequence_Number;
+            int sack_permitted = 0;
+            parseOptions(buffer, number_of_bytes_read, NULL, &sack_permitted);
+            cb->sack_permitted = sack_permitted;
+            if (sack_permitted)
+                logLog("init", "The receiver takes selective acknowledgements.");
             cb->maximum_window_size = synack_packet.hdr->windowSize;
+            // Without a sample, data starts over from the initial
+            // timeout rather than the one backed off by lost SYNs
+            if (!syn_retransmitted)
+                updateRTO(cb, currentTime() - syn_sent_at);
+            else
+                cb->rto = max(min_rto, min(STCP_INITIAL_TIMEOUT, max_rto));
             packet ack_packet;
             createPacket(&ack_packet, ACK, 0, cb->current_sequence_Number, cb->current_acknowledgement_number, NULL, 0);
-            send(cb->fd, &ack_packet, ack_packet.len, 0);
+            send(cb->fd, ack_packet.data, ack_packet.len, 0);
         }
         else
+        {
             logLog("init", "Did not receive the correct SYN-ACK packet, will retry.");
+            number_of_bytes_read = 0;
+        }
     }
 
     if (cb == NULL)
@@ -454,58 +919,14 @@ int stcp_close(stcp_send_ctrl_blk *cb)
     cb->state = STCP_SENDER_CLOSING;
     logLog("init", "There are still %d bytes in flight. Waiting for ACKs.", cb->number_of_bytes_in_flight);
 
-    while (cb->number_of_bytes_in_flight > 0)
+    // send what is left of the last burst
+    transmitWindow(cb);
+
+    while (cb->window_count > 0)
     {
         // wait for ACKs
-        unsigned char buffer[STCP_MTU];
-        int number_of_bytes_read = 0;
-        int timeout = STCP_INITIAL_TIMEOUT;
-        while (number_of_bytes_read <= 0)
-        {
-            number_of_bytes_read = readWithTimeout(cb->fd, buffer, timeout);
-
-            if (number_of_bytes_read == STCP_READ_TIMED_OUT)
-            {
-                if (cb->window_head != NULL)
-                {
-                    send(cb->fd, cb->window_head->packet, cb->window_head->packet->len, MSG_NOSIGNAL);
-                    timeout = min(timeout * 2, STCP_MAX_TIMEOUT);
-                }
-                else
-                    cb->number_of_bytes_in_flight = 0;
-            }
-
-            else if (number_of_bytes_read == STCP_READ_PERMANENT_FAILURE)
-                return STCP_ERROR;
-
-            if (ipchecksum(buffer, number_of_bytes_read) != 0 && cb->window_head != NULL)
-            {
-                logLog("init", "Checksum did not return 0. Ignoring packet.");
-
-                number_of_bytes_read = 0;
-                continue;
-            }
-            packet ack_packet;
-            createReceivingPacket(&ack_packet, buffer, number_of_bytes_read);
-
-            unsigned int recieved_acknowledgement_number = ack_packet.hdr->ackNo;
-
-            moveWindow(cb, recieved_acknowledgement_number);
-
-            if (cb->window_head == NULL)
-            {
-                break;
-            }
-            logLog("init", "Received an ACK, moving window to %d", recieved_acknowledgement_number);
-
-            if (cb->last_acknowledgement_number == recieved_acknowledgement_number)
-                cb->repeat_acknowledgements = cb->repeat_acknowledgements + 1;
-            else
-                cb->repeat_acknowledgements = 1;
-            if (cb->repeat_acknowledgements == 3)
-                retransmitWindow(cb);
-            cb->last_acknowledgement_number = recieved_acknowledgement_number;
-        }
+        if (awaitAck(cb) == STCP_ERROR)
+            return STCP_ERROR;
     }
 
     logLog("init", "Sending the FIN packet.");
@@ -513,23 +934,23 @@ int stcp_close(stcp_send_ctrl_blk *cb)
     // close connection by sending FIN
     packet fin_packet;
     createPacket(&fin_packet, FIN, 0, cb->current_sequence_Number, cb->current_acknowledgement_number, NULL, 0);
-    send(cb->fd, &fin_packet, fin_packet.len, MSG_NOSIGNAL);
+    send(cb->fd, fin_packet.data, fin_packet.len, MSG_NOSIGNAL);
 
     cb->state = STCP_SENDER_FIN_WAIT;
 
     // Send FIN
     unsigned char buffer[STCP_MTU];
     int number_of_bytes_read = 0;
-    int timeout = STCP_INITIAL_TIMEOUT;
 
     while (number_of_bytes_read <= 0)
     {
-        number_of_bytes_read = readWithTimeout(cb->fd, buffer, timeout);
+        number_of_bytes_read = readWithTimeout(cb->fd, buffer, cb->rto);
 
         if (number_of_bytes_read == STCP_READ_TIMED_OUT)
         {
-            send(cb->fd, &fin_packet, fin_packet.len, MSG_NOSIGNAL);
-            timeout = min(timeout * 2, STCP_MAX_TIMEOUT);
+            send(cb->fd, fin_packet.data, fin_packet.len, MSG_NOSIGNAL);
+            backOffRTO(cb);
+            continue;
         }
 
         else if (number_of_bytes_read == STCP_READ_PERMANENT_FAILURE)
@@ -554,7 +975,7 @@ int stcp_close(stcp_send_ctrl_blk *cb)
             createPacket(&ack_packet, ACK, 0, 0, cb->current_acknowledgement_number, NULL, 0);
             logLog("init", "Received the FIN-ACK and will send an ACK");
 
-            send(cb->fd, &ack_packet, ack_packet.len, MSG_NOSIGNAL);
+            send(cb->fd, ack_packet.data, ack_packet.len, MSG_NOSIGNAL);
 
             cb->state = STCP_SENDER_CLOSED;
             break;
@@ -596,11 +1017,43 @@ int main(int argc, char **argv)
     int num_read_bytes;
 
     logConfig("sender", "init,segment,error,failure");
+
+    /* Options come before the other arguments */
+    int opt, usage_error = 0;
+    while ((opt = getopt(argc, argv, "c:gm:M:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            congestion = congestionLookup(optarg);
+            if (congestion == NULL)
+                usage_error = 1;
+            break;
+        case 'g':
+            segmentation_offload = 1;
+            break;
+        case 'm':
+            min_rto = atoi(optarg);
+            break;
+        case 'M':
+            max_rto = atoi(optarg);
+            break;
+        default:
+            usage_error = 1;
+        }
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
+
     /* Verify that the arguments are right */
-    if (argc > 5 || argc == 1)
+    if (usage_error || argc > 5 || argc == 1 || min_rto < 1 || max_rto < min_rto)
     {
-        fprintf(stderr, "usage: sender DestinationIPAddress/Name receiveDataOnPort sendDataToPort filename\n");
-        fprintf(stderr, "or   : sender filename\n");
+        fprintf(stderr, "usage: sender [options] DestinationIPAddress/Name receiveDataOnPort sendDataToPort filename\n");
+        fprintf(stderr, "or   : sender [options] filename\n");
+        fprintf(stderr, "options: -c reno|cubic|bbr  congestion control algorithm (default reno)\n");
+        fprintf(stderr, "         -g     send bursts with UDP segmentation offload\n");
+        fprintf(stderr, "         -m ms  lower bound of the retransmission timeout (default %d)\n", STCP_DEFAULT_MIN_RTO);
+        fprintf(stderr, "         -M ms  upper bound of the retransmission timeout (default %d)\n", STCP_MAX_TIMEOUT);
         exit(1);
     }
     if (argc == 2)
@@ -5,6 +5,7 @@
  * Version 1.0
  */
 
+#define _GNU_SOURCE             /* For recvmmsg() and sendmmsg() */
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,10 +17,18 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 
 #include "stcp.h"
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103         /* Linux 4.18 and later */
+#endif
+
+/* Most datagrams the kernel makes of one segmented send */
+#define UDP_MAX_SEGMENTS 64
+
 
 /*
  * Convert a DNS name or numeric IP address into an integer value
@@ -134,6 +143,150 @@ int readWithTimeout(int fd, unsigned char *pkt, int ms) {
     }
 }
 
+/*
+ * Read all the packets that are waiting, up to count, with a single
+ * system call. Waits up to ms milliseconds for the first one. Packet i
+ * goes into pkts[i], and its length into lens[i]. As a side effect
+ * print the packet headers.
+ *
+ * Returns:
+ *   the number of packets read,
+ *   STCP_READ_TIMED_OUT if none arrived in time, or
+ *   STCP_READ_PERMANENT_FAILURE if reads will never work again (socket closed)
+ */
+int readManyWithTimeout(int fd, unsigned char pkts[][STCP_MTU], int *lens, int count, int ms) {
+    struct mmsghdr msgs[count];
+    struct iovec iovs[count];
+    fd_set fds;
+    struct timeval tv;
+    int i, n;
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms - tv.tv_sec * 1000) * 1000;
+
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    if (select(fd + 1, &fds, 0, 0, &tv) <= 0 || !FD_ISSET(fd, &fds))
+        return STCP_READ_TIMED_OUT;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < count; i++) {
+        iovs[i].iov_base = pkts[i];
+        iovs[i].iov_len = STCP_MTU;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return STCP_READ_TIMED_OUT;
+        logPerror("readManyWithTimeout");
+        return errno == ECONNREFUSED ? STCP_READ_PERMANENT_FAILURE : STCP_READ_TIMED_OUT;
+    }
+
+    for (i = 0; i < n; i++) {
+        tcpheader *hdr = (tcpheader *)pkts[i];
+        lens[i] = msgs[i].msg_len;
+        ntohHdr(hdr);
+        dump('r', pkts[i], lens[i]);
+        htonHdr(hdr);
+    }
+    return n;
+}
+
+/*
+ * Send count packets with a single system call (or a few, if the socket
+ * takes only part of them at once).
+ *
+ * Returns the number of packets sent, or -1 on error.
+ */
+int sendMany(int fd, packet **pkts, int count) {
+    struct mmsghdr msgs[count];
+    struct iovec iovs[count];
+    int i, sent = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < count; i++) {
+        iovs[i].iov_base = pkts[i]->data;
+        iovs[i].iov_len = pkts[i]->len;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (sent < count) {
+        int n = sendmmsg(fd, msgs + sent, count - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+/*
+ * Send count packets as runs of consecutive packets of equal size, each
+ * run handed to the kernel as one buffer together with the size to cut
+ * it into datagrams at (UDP segmentation offload). The last packet of a
+ * run may be shorter. All the runs go with a single system call.
+ *
+ * Returns the number of packets sent. If that is less than count, errno
+ * tells why; EIO, EINVAL, ENOPROTOOPT or EOPNOTSUPP mean the kernel or
+ * the device cannot segment, and the packets should be sent one by one.
+ */
+int sendSegmented(int fd, packet **pkts, int count) {
+    struct mmsghdr msgs[count];
+    struct iovec iovs[count];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } controls[count];
+    int starts[count + 1];
+    int i, runs = 0, sent = 0;
+    int size = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    memset(controls, 0, sizeof(controls));
+    for (i = 0; i < count; i++) {
+        iovs[i].iov_base = pkts[i]->data;
+        iovs[i].iov_len = pkts[i]->len;
+
+        // A packet continues the run if the run has not ended with a
+        // shorter packet yet and it is no longer than the others
+        if (runs > 0 && pkts[i - 1]->len == size && pkts[i]->len <= size &&
+            msgs[runs - 1].msg_hdr.msg_iovlen < UDP_MAX_SEGMENTS) {
+            msgs[runs - 1].msg_hdr.msg_iovlen++;
+            continue;
+        }
+
+        struct msghdr *hdr = &msgs[runs].msg_hdr;
+        size = pkts[i]->len;
+        hdr->msg_iov = &iovs[i];
+        hdr->msg_iovlen = 1;
+        hdr->msg_control = controls[runs].buf;
+        hdr->msg_controllen = sizeof(controls[runs].buf);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cmsg) = size;
+        starts[runs++] = i;
+    }
+    starts[runs] = count;
+
+    while (sent < runs) {
+        int n = sendmmsg(fd, msgs + sent, runs - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        sent += n;
+    }
+    return starts[sent];
+}
+
 /*
  * Set an I/O channel (file descriptor) to non-blocking mode.
  */
@@ -60,6 +60,9 @@ extern void createSegment(packet *pkt, int flags, unsigned short rwnd, unsigned
 extern void dump(char dir, void* pkt, int len);
 extern unsigned int hostname_to_ipaddr(const char *s);
 extern int readWithTimeout(int fd, unsigned char *pkt, int ms);
+extern int readManyWithTimeout(int fd, unsigned char pkts[][STCP_MTU], int *lens, int count, int ms);
+extern int sendMany(int fd, packet **pkts, int count);
+extern int sendSegmented(int fd, packet **pkts, int count);
 extern unsigned short ipchecksum(void *data, int len);
 extern int udp_open(char *remote_IP_str, int remote_port, int local_port);
 
@@ -12,6 +12,13 @@ typedef struct tcpheader {
     unsigned short urgentPointer;               // Not used (should always be 0)
 } tcpheader;
 
+/* Options follow the fixed header when dataOffset, the header length in
+ * 32-bit words, is more than 5 */
+#define TCP_OPTION_END 0
+#define TCP_OPTION_NOP 1
+#define TCP_OPTION_SACK_PERMITTED 4     /* Kind, length 2; SYN only */
+#define TCP_OPTION_SACK 5               /* Kind, length, then left and right edges */
+
 typedef enum tcpflags {
     FIN = 0b000000001,
     SYN = 0b000000010,